@@ -7,14 +7,17 @@ uniform mat4 proj_mat;
 uniform mat4 view_mat;
 uniform mat3 normal_mat;
 
-in vec3 vtx_position;
-in vec3 vtx_normal;
-in vec2 vtx_texcoord;
+// number of cells of the procedural grid along u and v
+uniform ivec2 grid_res;
 
 out vec3 v_normal;
 out vec3 v_view;
 out vec2 v_uv;
 
+// corners of the 2 triangles of a grid cell
+const ivec2 cell_corners[6] = ivec2[6](ivec2(0,0), ivec2(1,0), ivec2(1,1),
+                                       ivec2(0,0), ivec2(1,1), ivec2(0,1));
+
 vec3 cylinder(vec2 uv, float r, float l)
 {
     return vec3(r*cos(uv.x*2*M_PI), r*sin(uv.x*2*M_PI), l*uv.y);
@@ -22,7 +25,9 @@ vec3 cylinder(vec2 uv, float r, float l)
 
 void main()
 {
-    v_uv  = vtx_texcoord;
+    // one instance per row of cells, 6 vertices per cell
+    ivec2 ij = ivec2(gl_VertexID / 6, gl_InstanceID) + cell_corners[gl_VertexID % 6];
+    v_uv  = vec2(ij) / vec2(grid_res);
     vec3 pos = cylinder(v_uv, 0.5, 5);
     vec3 normal = vec3(pos.x,pos.y,0);
 
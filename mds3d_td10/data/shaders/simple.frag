@@ -1,11 +1,20 @@
 #version 330 core
 
+// compile-time variants: WIREFRAME (requires simple.geom)
+
+#ifdef WIREFRAME
+in vec3 g_normal;
+in vec3 g_view;
+noperspective in vec3 g_edge_dist;
+#define v_normal g_normal
+#define v_view g_view
+#else
 in vec3 v_normal;
 in vec3 v_view;
+#endif
 
 uniform vec3 color;
 uniform vec3 lightDir;
-uniform int wireframe;
 
 out vec4 out_color;
 
@@ -26,8 +35,12 @@ void main(void) {
 
   vec3 blinnColor = blinn(normalize(v_normal),normalize(v_view), lightDir, color, spec_color, shininess);
 
-  if(wireframe==1)
-    out_color = vec4(0.9,0.1,0.1,1);
-  else
-    out_color = vec4(ambient * color + blinnColor,1.0);
+  out_color = vec4(ambient * color + blinnColor,1.0);
+
+#ifdef WIREFRAME
+  // antialiased edges of about 1 pixel
+  float d = min(g_edge_dist.x, min(g_edge_dist.y, g_edge_dist.z));
+  float edge = 1.0 - smoothstep(0.5, 1.5, d);
+  out_color.rgb = mix(out_color.rgb, vec3(0.9,0.1,0.1), edge);
+#endif
 }
@@ -5,16 +5,32 @@ uniform mat4 proj_mat;
 uniform mat4 view_mat;
 uniform mat3 normal_mat;
 
+// decoding of quantized vertices (identity for float vertices)
+uniform vec3 pos_offset = vec3(0);
+uniform vec3 pos_scale = vec3(1);
+uniform bool oct_normals = false;
+
 in vec3 vtx_position;
 in vec3 vtx_normal;
 
 out vec3 v_normal;
 out vec3 v_view;
 
+vec3 octDecode(vec2 e)
+{
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  if(n.z < 0)
+    n.xy = (1.0 - abs(e.yx)) * mix(vec2(-1.0), vec2(1.0), greaterThanEqual(e, vec2(0.0)));
+  return normalize(n);
+}
+
 void main()
 {
-  v_normal = normalize(normal_mat * vtx_normal);
-  vec4 p = view_mat * (obj_mat * vec4(vtx_position, 1.));
+  vec3 position = pos_offset + pos_scale * vtx_position;
+  vec3 normal = oct_normals ? octDecode(vtx_normal.xy) : vtx_normal;
+
+  v_normal = normalize(normal_mat * normal);
+  vec4 p = view_mat * (obj_mat * vec4(position, 1.));
   v_view = normalize(-p.xyz);
   gl_Position = proj_mat * p;
 }
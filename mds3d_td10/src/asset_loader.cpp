@@ -0,0 +1,78 @@
+#include "asset_loader.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+void AssetLoader::add(const std::string& name, const std::function<bool()>& load, const std::function<void()>& upload)
+{
+    Asset asset;
+    asset.name = name;
+    asset.load = load;
+    asset.upload = upload;
+    mAssets.push_back(asset);
+}
+
+bool AssetLoader::run()
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    int n = int(mAssets.size());
+    std::atomic<int> next(0);
+    std::mutex mutex;
+    std::condition_variable done;
+    std::queue<std::pair<int,bool> > completed; // (asset, success)
+
+    std::vector<std::thread> workers;
+    int nbWorkers = std::min(nbThreads(), n);
+    for(int w=0; w<nbWorkers; ++w)
+    {
+        workers.push_back(std::thread([&]() {
+            int i;
+            while((i = next++) < n)
+            {
+                bool ok = mAssets[i].load();
+                std::lock_guard<std::mutex> lock(mutex);
+                completed.push(std::make_pair(i, ok));
+                done.notify_one();
+            }
+        }));
+    }
+
+    // uploads in completion order, while the other assets are still loading
+    bool allIsOk = true;
+    for(int k=0; k<n; ++k)
+    {
+        std::pair<int,bool> c;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&]() { return !completed.empty(); });
+            c = completed.front();
+            completed.pop();
+        }
+        if(c.second)
+        {
+            mAssets[c.first].upload();
+        }
+        else
+        {
+            std::cerr << "AssetLoader: failed to load " << mAssets[c.first].name << std::endl;
+            allIsOk = false;
+        }
+    }
+
+    for(std::size_t w=0; w<workers.size(); ++w)
+        workers[w].join();
+    mAssets.clear();
+
+    std::cout << "Assets loaded in "
+              << std::chrono::duration<double, std::milli>(Clock::now()-start).count() << " ms" << std::endl;
+    return allIsOk;
+}
@@ -0,0 +1,35 @@
+#ifndef ASSET_LOADER_H
+#define ASSET_LOADER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/** Loads a set of assets on a pool of worker threads.
+  * Each asset has a \c load function, run on a worker (file parsing, BVH build, image decoding, ...),
+  * which must not call OpenGL, and an \c upload function run on the thread calling run()
+  * (i.e., the one owning the GL context) as soon as its \c load is done.
+  * The total time is thus close to the one of the slowest asset.
+  */
+class AssetLoader
+{
+public:
+    /** Adds an asset named \a name (for error messages).
+      * \a upload is called only if \a load returns true. */
+    void add(const std::string& name, const std::function<bool()>& load, const std::function<void()>& upload);
+
+    /** Loads all the assets added so far, and clears the list.
+      * \return false if at least one of them failed to load */
+    bool run();
+
+private:
+    struct Asset
+    {
+        std::string name;
+        std::function<bool()> load;
+        std::function<void()> upload;
+    };
+    std::vector<Asset> mAssets;
+};
+
+#endif // ASSET_LOADER_H
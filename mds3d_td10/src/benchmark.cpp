@@ -0,0 +1,101 @@
+#include "benchmark.h"
+#include "opengl.h"
+#include "viewer.h"
+#include "frame_capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+using namespace Eigen;
+
+namespace {
+
+/** camera path: one orbit around the scene, at the height and distance of the default view */
+void setCameraAlongPath(Camera& camera, float t)
+{
+    float angle = 2.f*float(M_PI)*t;
+    Vector3f position(6.f*std::sin(angle), -6.f*std::cos(angle), 8.f);
+    camera.lookAt(position, Vector3f::Zero(), Vector3f::UnitZ());
+}
+
+} // namespace
+
+void printFrameStats(const char* name, std::vector<double> times)
+{
+    if(times.empty())
+        return;
+    std::sort(times.begin(), times.end());
+    double mean = std::accumulate(times.begin(), times.end(), 0.) / times.size();
+    std::cout << "  " << name << " (ms): mean " << mean
+              << ", median " << times[times.size()/2]
+              << ", 95% " << times[std::min(times.size()-1, times.size()*95/100)]
+              << ", min " << times.front() << ", max " << times.back() << std::endl;
+}
+
+bool runBenchmark(Viewer& viewer, int width, int height, const BenchmarkOptions& options)
+{
+    // the default framebuffer of a hidden window may not be backed by memory
+    GLuint fbo, renderbuffers[2];
+    glGenFramebuffers(1, &fbo);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER)==GL_FRAMEBUFFER_COMPLETE;
+    if(!complete)
+        std::cerr << "Benchmark: incomplete framebuffer" << std::endl;
+
+    GLuint query;
+    glGenQueries(1, &query);
+
+    FrameCapture capture;
+    if(complete && !options.pngDir.empty())
+        capture.start(options.pngDir, width, height);
+
+    std::vector<double> cpuTimes, gpuTimes;
+    typedef std::chrono::high_resolution_clock Clock;
+    int nbFrames = options.warmupFrames + options.nbFrames;
+    for(int i=0; complete && i<nbFrames; ++i)
+    {
+        setCameraAlongPath(viewer.camera(), float(i)/float(nbFrames));
+
+        Clock::time_point start = Clock::now();
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        viewer.updateAndDrawScene();
+        glEndQuery(GL_TIME_ELAPSED);
+        glFinish();
+        double cpuTime = std::chrono::duration<double, std::milli>(Clock::now()-start).count();
+
+        GLuint64 gpuTime;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuTime);
+
+        if(i<options.warmupFrames)
+            continue;
+        cpuTimes.push_back(cpuTime);
+        gpuTimes.push_back(double(gpuTime)*1e-6);
+
+        capture.capture();
+    }
+
+    capture.stop();
+    if(!cpuTimes.empty())
+    {
+        std::cout << "Benchmark: " << cpuTimes.size() << " frames of " << width << "x" << height << std::endl;
+        printFrameStats("frame", cpuTimes);
+        printFrameStats("GPU  ", gpuTimes);
+    }
+
+    glDeleteQueries(1, &query);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(2, renderbuffers);
+    glDeleteFramebuffers(1, &fbo);
+    return complete;
+}
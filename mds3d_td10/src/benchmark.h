@@ -0,0 +1,29 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <string>
+#include <vector>
+
+class Viewer;
+
+/** Options of the headless mode (see the --headless command line option) */
+struct BenchmarkOptions
+{
+    BenchmarkOptions() : nbFrames(300), warmupFrames(10) {}
+
+    int nbFrames;       ///< number of measured frames
+    int warmupFrames;   ///< frames rendered before the measures (shader compilation, uploads, ...)
+    std::string pngDir; ///< if not empty, the measured frames are captured there (see FrameCapture::start())
+};
+
+/** Renders \a options.nbFrames frames of \a viewer into an offscreen framebuffer of size \a width x \a height,
+  * the camera orbiting around the scene, and prints the CPU and GPU frame times.
+  * A GL context must be current (e.g., of a hidden window).
+  * \return false if the framebuffer cannot be created
+  */
+bool runBenchmark(Viewer& viewer, int width, int height, const BenchmarkOptions& options);
+
+/** Prints the mean, median, 95th percentile, min and max of \a times (in ms) */
+void printFrameStats(const char* name, std::vector<double> times);
+
+#endif // BENCHMARK_H
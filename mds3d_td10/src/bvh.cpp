@@ -1,13 +1,159 @@
 #include "bvh.h"
 #include "mesh.h"
+#include "parallel.h"
 // #include "glPrimitives.h"
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <limits>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+/** cost of traversing a node, relative to a ray-triangle intersection (SAH) */
+const float traversalCost = .125f;
+
+/** largest treelet handled by BVH::optimize(): the dynamic programming is in O(3^n) */
+const int maxTreeletSize = 10;
+
+/** maximal depth of the tree of 8-wide nodes, which bounds the traversal stack of BVH::intersectWide() */
+const int maxWideDepth = 128;
+
+/** 2^e for -126 <= e <= 127, directly from the bits of the float */
+inline float exp2i(int e)
+{
+    uint32_t bits = uint32_t(e+127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/** depth of the node pairs traversed in parallel by BVH::intersects() */
+const int collisionSplitDepth = 6;
+
+typedef Eigen::Array4f A4;
+typedef Eigen::Array<bool,4,1> Mask4;
+
+/** sine of the angle below which BVH::intersects() considers a segment as lying in the plane of a triangle */
+const float coplanarSine = 1e-5f;
+
+/** Lanes k for which the segment [p_k, p_k+d_k] crosses the triangle (v0_k, v0_k+e1_k, v0_k+e2_k) (Moller-Trumbore, t in [0,1]).
+  * Segments (almost) parallel to the plane never cross it. */
+inline Mask4 segmentsCrossTriangles(const A4 p[3], const A4 d[3], const A4 v0[3], const A4 e1[3], const A4 e2[3])
+{
+    // q = d x e2
+    A4 qx = d[1]*e2[2] - d[2]*e2[1];
+    A4 qy = d[2]*e2[0] - d[0]*e2[2];
+    A4 qz = d[0]*e2[1] - d[1]*e2[0];
+    A4 det = e1[0]*qx + e1[1]*qy + e1[2]*qz;
+    // det = d.(e1 x e2), compared to |d| |e1 x e2|
+    A4 nx = e1[1]*e2[2] - e1[2]*e2[1];
+    A4 ny = e1[2]*e2[0] - e1[0]*e2[2];
+    A4 nz = e1[0]*e2[1] - e1[1]*e2[0];
+    Mask4 crossing = det.square() > (coplanarSine*coplanarSine) * (d[0].square()+d[1].square()+d[2].square()) * (nx.square()+ny.square()+nz.square());
+    A4 invDet = det.inverse();
+    A4 tx = p[0]-v0[0], ty = p[1]-v0[1], tz = p[2]-v0[2];
+    A4 u = (tx*qx + ty*qy + tz*qz) * invDet;
+    // r = t x e1
+    A4 rx = ty*e1[2] - tz*e1[1];
+    A4 ry = tz*e1[0] - tx*e1[2];
+    A4 rz = tx*e1[1] - ty*e1[0];
+    A4 v = (d[0]*rx + d[1]*ry + d[2]*rz) * invDet;
+    A4 t = (e2[0]*rx + e2[1]*ry + e2[2]*rz) * invDet;
+    return crossing && (u>=0.f) && (v>=0.f) && ((u+v)<=1.f) && (t>=0.f) && (t<=1.f);
+}
+
+/** largest leaf created by BVH::optimize() when collapsing subtrees */
+const int maxCollapsedLeafSize = 8;
+
+/** spreads the 10 lower bits of \a x, inserting 2 zeros between each of them */
+inline uint32_t expandBits(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | x << 16) & 0x30000ff;
+    x = (x | x << 8)  & 0x300f00f;
+    x = (x | x << 4)  & 0x30c30c3;
+    x = (x | x << 2)  & 0x9249249;
+    return x;
+}
+
+/** Sorts \a keys with a parallel LSD radix sort, 8 bits per pass, starting at the bit \a firstBit */
+void radixSort(std::vector<uint64_t>& keys, int firstBit)
+{
+    int n = int(keys.size());
+    std::vector<uint64_t> keys2(n);
+    int nbChunks = std::max(1, std::min(nbThreads(), n/4096));
+    int chunkSize = (n+nbChunks-1)/nbChunks;
+    std::vector<int> counts(nbChunks*256);
+
+    for(int shift=firstBit; shift<64; shift+=8)
+    {
+        // 1 - histogram of each chunk
+        std::fill(counts.begin(), counts.end(), 0);
+        parallelFor(nbChunks, [&](int c0, int c1) {
+            for(int c=c0; c<c1; ++c)
+            {
+                int* h = &counts[c*256];
+                for(int i=c*chunkSize; i<std::min(n,(c+1)*chunkSize); ++i)
+                    ++h[(keys[i]>>shift) & 0xff];
+            }
+        }, 1);
+
+        // skip the passes where all the keys have the same digit
+        bool sorted = false;
+        for(int d=0; d<256 && !sorted; ++d)
+        {
+            int total = 0;
+            for(int c=0; c<nbChunks; ++c)
+                total += counts[c*256+d];
+            sorted = total==n;
+        }
+        if(sorted)
+            continue;
+
+        // 2 - where each chunk writes each digit: digit major, chunk minor, for a stable sort
+        int offset = 0;
+        for(int d=0; d<256; ++d)
+            for(int c=0; c<nbChunks; ++c)
+            {
+                int count = counts[c*256+d];
+                counts[c*256+d] = offset;
+                offset += count;
+            }
+
+        // 3 - scatter
+        parallelFor(nbChunks, [&](int c0, int c1) {
+            for(int c=c0; c<c1; ++c)
+            {
+                int* o = &counts[c*256];
+                for(int i=c*chunkSize; i<std::min(n,(c+1)*chunkSize); ++i)
+                    keys2[o[(keys[i]>>shift) & 0xff]++] = keys[i];
+            }
+        }, 1);
+        keys.swap(keys2);
+    }
+}
+
+/** length of the common prefix of the keys i and j (-1 if j is out of range) */
+inline int commonPrefix(const std::vector<uint64_t>& keys, int i, int j)
+{
+    if(j<0 || j>=int(keys.size()))
+        return -1;
+    // the keys are unique (they contain the face index)
+    return __builtin_clzll(keys[i] ^ keys[j]);
+}
+
+} // namespace
 
 void BVH::build(const Mesh* pMesh, int targetCellSize, int maxDepth)
 {
     m_splitMethod = SPLIT_MIDDLE;
     m_pMesh = pMesh;
+    m_wideNodes.clear();
     m_nodes.resize(1);
     if(m_pMesh->nbFaces() <= targetCellSize) {
         m_nodes[0].box = pMesh->boundingBox();
@@ -31,10 +177,169 @@ void BVH::build(const Mesh* pMesh, int targetCellSize, int maxDepth)
         }
         buildNode(0, 0, m_pMesh->nbFaces(), 0, targetCellSize, maxDepth);
     }
+    packTriangles();
+}
+
+void BVH::buildLinear(const Mesh* pMesh, int targetCellSize)
+{
+    m_pMesh = pMesh;
+    m_wideNodes.clear();
+    int n = m_pMesh->nbFaces();
+    m_nodes.clear();
+    if(n==0)
+    {
+        // empty root leaf, as build() and buildSpatial()
+        m_nodes.resize(1);
+        m_nodes[0].box.setNull();
+        m_nodes[0].first_face_id = 0;
+        m_nodes[0].nb_faces = 0;
+        m_nodes[0].is_leaf = true;
+        m_faces.clear();
+        packTriangles();
+        return;
+    }
+
+    // 1 - centroids and their bounding box
+    m_centroids.resize(n);
+    parallelFor(n, [this](int start, int end) {
+        for(int i=start; i<end; ++i)
+            m_centroids[i] = (m_pMesh->vertexOfFace(i, 0).position + m_pMesh->vertexOfFace(i, 1).position + m_pMesh->vertexOfFace(i, 2).position)/3.f;
+    });
+    Eigen::AlignedBox3f centroidBox;
+    centroidBox.setNull();
+    for(int i=0; i<n; ++i)
+        centroidBox.extend(m_centroids[i]);
+
+    // 2 - keys: Morton code of the centroid quantized to 10 bits per axis, then the face index
+    // (which makes the keys unique), sorted
+    std::vector<uint64_t> codes(n);
+    Vector3f scale = Vector3f::Constant(1023.f).cwiseQuotient(centroidBox.sizes().cwiseMax(1e-20f));
+    parallelFor(n, [&](int start, int end) {
+        for(int i=start; i<end; ++i)
+        {
+            Eigen::Vector3i q = (m_centroids[i]-centroidBox.min()).cwiseProduct(scale).cast<int>();
+            uint64_t morton = expandBits(q.x())<<2 | expandBits(q.y())<<1 | expandBits(q.z());
+            codes[i] = morton<<32 | uint64_t(i);
+        }
+    });
+    // the face indices are already in order
+    radixSort(codes, 32);
+    m_faces.resize(n);
+    parallelFor(n, [&](int start, int end) {
+        for(int i=start; i<end; ++i)
+            m_faces[i] = int(codes[i] & 0xffffffff);
+    });
+
+    // 3 - radix tree: the internal node i covers the keys ranges[i], its children are the internal nodes
+    // (or the leaves if negative, offset by one) children[i]. The root is the internal node 0.
+    std::vector<Eigen::Vector2i> children(std::max(1,n-1)), ranges(std::max(1,n-1));
+    parallelFor(n-1, [&](int start, int end) {
+        for(int i=start; i<end; ++i)
+        {
+            // direction and end of the range
+            int d = commonPrefix(codes, i, i+1) > commonPrefix(codes, i, i-1) ? 1 : -1;
+            int minPrefix = commonPrefix(codes, i, i-d);
+            int lMax = 2;
+            while(commonPrefix(codes, i, i+lMax*d) > minPrefix)
+                lMax *= 2;
+            int l = 0;
+            for(int t=lMax/2; t>=1; t/=2)
+                if(commonPrefix(codes, i, i+(l+t)*d) > minPrefix)
+                    l += t;
+            int j = i+l*d;
+
+            // split position: the highest differing bit
+            int nodePrefix = commonPrefix(codes, i, j);
+            int s = 0, t = l;
+            do {
+                t = (t+1)/2;
+                if(commonPrefix(codes, i, i+(s+t)*d) > nodePrefix)
+                    s += t;
+            } while(t>1);
+            int gamma = i + s*d + std::min(d,0);
+
+            int first = std::min(i,j), last = std::max(i,j);
+            ranges[i] = Eigen::Vector2i(first, last);
+            children[i] = Eigen::Vector2i(first==gamma ? -gamma-1 : gamma, last==gamma+1 ? -(gamma+1)-1 : gamma+1);
+        }
+    }, 1024);
+
+    // 4 - nodes in the same depth-first layout as build(), the small subtrees become leaves
+    m_nodes.reserve(2*(n/std::max(1,targetCellSize)+1));
+    m_nodes.resize(1);
+    std::vector<int> parents(1, -1);
+    emitLinearNode(0, 0, n==1, targetCellSize, children, ranges, parents);
+
+    // 5 - boxes
+    computeBoxes(parents);
+    packTriangles();
+}
+
+void BVH::emitLinearNode(int nodeId, int id, bool isLeaf, int targetCellSize,
+                         const std::vector<Eigen::Vector2i>& children, const std::vector<Eigen::Vector2i>& ranges,
+                         std::vector<int>& parents)
+{
+    int first = isLeaf ? id : ranges[id][0];
+    int last = isLeaf ? id : ranges[id][1];
+    Node& node = m_nodes[nodeId];
+    if(last-first+1 <= targetCellSize)
+    {
+        node.is_leaf = true;
+        node.first_face_id = first;
+        node.nb_faces = last-first+1;
+        return;
+    }
+    node.is_leaf = false;
+    int child_id = node.first_child_id = int(m_nodes.size());
+    m_nodes.resize(m_nodes.size()+2);
+    parents.resize(m_nodes.size(), nodeId);
+    // node is not a valid reference anymore !
+    for(int k=0; k<2; ++k)
+    {
+        int c = children[id][k];
+        emitLinearNode(child_id+k, c<0 ? -c-1 : c, c<0, targetCellSize, children, ranges, parents);
+    }
+}
+
+void BVH::computeBoxes(const std::vector<int>& parents)
+{
+    // each leaf walks up to the root, the second child to arrive at a node computes its box
+    int nbNodes = int(m_nodes.size());
+    std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[nbNodes]);
+    for(int n=0; n<nbNodes; ++n)
+        visits[n].store(0, std::memory_order_relaxed);
+
+    parallelFor(nbNodes, [&](int start, int end) {
+        for(int n=start; n<end; ++n)
+        {
+            Node& node = m_nodes[n];
+            if(!node.is_leaf)
+                continue;
+            node.box.setNull();
+            for(int i=node.first_face_id; i<node.first_face_id+node.nb_faces; ++i)
+            {
+                node.box.extend(m_pMesh->vertexOfFace(m_faces[i], 0).position);
+                node.box.extend(m_pMesh->vertexOfFace(m_faces[i], 1).position);
+                node.box.extend(m_pMesh->vertexOfFace(m_faces[i], 2).position);
+            }
+            for(int p=parents[n]; p>=0; p=parents[p])
+            {
+                // acq_rel: the first thread publishes its box, the second one reads it
+                if(visits[p].fetch_add(1, std::memory_order_acq_rel)==0)
+                    break;
+                Node& parent = m_nodes[p];
+                parent.box = m_nodes[parent.first_child_id].box.merged(m_nodes[parent.first_child_id+1].box);
+            }
+        }
+    }, 256);
 }
 
 bool BVH::intersect(const Ray& ray, Hit& hit) const
 {
+    if(m_faces.empty())
+        return false;
+    if(!m_wideNodes.empty())
+        return intersectWide(ray, hit);
     float tMin, tMax;
     Normal3f normal;
     ::intersect(ray, m_nodes[0].box, tMin, tMax, normal);
@@ -43,6 +348,74 @@ bool BVH::intersect(const Ray& ray, Hit& hit) const
     return false;
 }
 
+void BVH::refit()
+{
+    m_wideNodes.clear();
+    std::vector<int> parents(m_nodes.size(), -1);
+    for(std::size_t n=0; n<m_nodes.size(); ++n)
+    {
+        if(!m_nodes[n].is_leaf)
+            parents[m_nodes[n].first_child_id] = parents[m_nodes[n].first_child_id+1] = int(n);
+    }
+    computeBoxes(parents);
+    packTriangles();
+}
+
+void BVH::setFacesInLeafOrder()
+{
+    m_wideNodes.clear();
+    for(std::size_t i=0; i<m_faces.size(); ++i)
+        m_faces[i] = int(i);
+    packTriangles();
+}
+
+void BVH::remapFaces(const std::vector<int>& newIndex)
+{
+    for(std::size_t i=0; i<m_faces.size(); ++i)
+        m_faces[i] = newIndex[m_faces[i]];
+    for(std::size_t i=0; i<m_wideFaces.size(); ++i)
+        m_wideFaces[i] = newIndex[m_wideFaces[i]];
+    for(std::size_t b=0; b<m_blocks.size(); ++b)
+        for(int k=0; k<4; ++k)
+            if(m_blocks[b].face[k] >= 0)
+                m_blocks[b].face[k] = newIndex[m_blocks[b].face[k]];
+}
+
+/** Computes the range of faces covered by the subtree \a nodeId from its left-most and right-most leaves */
+void BVH::subtreeRange(int nodeId, int& start, int& end) const
+{
+    int n = nodeId;
+    while(!m_nodes[n].is_leaf)
+        n = m_nodes[n].first_child_id;
+    start = m_nodes[n].first_face_id;
+    n = nodeId;
+    while(!m_nodes[n].is_leaf)
+        n = m_nodes[n].first_child_id+1;
+    end = m_nodes[n].first_face_id + m_nodes[n].nb_faces;
+}
+
+void BVH::collectClusters(int maxFaces, std::vector<Eigen::AlignedBox3f>& boxes, std::vector<Eigen::Vector2i>& ranges) const
+{
+    boxes.clear();
+    ranges.clear();
+    if(!m_faces.empty())
+        collectClusters(0, maxFaces, boxes, ranges);
+}
+
+void BVH::collectClusters(int nodeId, int maxFaces, std::vector<Eigen::AlignedBox3f>& boxes, std::vector<Eigen::Vector2i>& ranges) const
+{
+    const Node& node = m_nodes[nodeId];
+    int start, end;
+    subtreeRange(nodeId, start, end);
+    if(node.is_leaf || end-start <= maxFaces)
+    {
+        boxes.push_back(node.box);
+        ranges.push_back(Eigen::Vector2i(start, end-start));
+        return;
+    }
+    collectClusters(node.first_child_id,   maxFaces, boxes, ranges);
+    collectClusters(node.first_child_id+1, maxFaces, boxes, ranges);
+}
 
 bool BVH::intersectNode(int nodeId, const Ray& ray, Hit& hit) const
 {
@@ -50,13 +423,7 @@ bool BVH::intersectNode(int nodeId, const Ray& ray, Hit& hit) const
 
     if(node.is_leaf)
     {
-        int end = node.first_child_id+node.nb_faces;
-        bool found = false;
-        for(int i=node.first_child_id; i<end; ++i)
-        {
-            found = found | m_pMesh->intersectFace(ray, hit, m_faces[i]);
-        }
-        return found;
+        return intersectFaces(ray, hit, node.first_face_id, node.nb_faces);
     }
     else
     {
@@ -108,8 +475,10 @@ int BVH::split(int start, int end, int dim, float split_value)
 }
 
 // box surface area = 2lw + 2lh + 2wh
-float surfaceArea(Eigen::AlignedBox3f& aabb)
+float surfaceArea(const Eigen::AlignedBox3f& aabb)
 {
+    if(aabb.isEmpty())
+        return 0.f;
     Vector3f diag = aabb.max() - aabb.min();
     return 2.f*(diag[0]*diag[1] + diag[0]*diag[2] + diag[1]*diag[2]);
 }
@@ -187,7 +556,7 @@ void BVH::buildNode(int nodeId, int start, int end, int level, int targetCellSiz
                    b1.extend(m_buckets[j].bounds);
                    count1 += m_buckets[j].count;
                }
-               cost[i] = .125f;
+               cost[i] = traversalCost;
                if(count0 > 0)
                     cost[i] += count0 * surfaceArea(b0) / mainSA;
                 if(count1 > 0)
@@ -233,3 +602,1083 @@ void BVH::buildNode(int nodeId, int start, int end, int level, int targetCellSiz
     buildNode(child_id+1, mid_id, end, level+1, targetCellSize, maxDepth);
 }
 
+
+namespace {
+
+const int nSpatialBins = 32;
+
+/** \returns the box of the part of the triangle \a v lying in the slab lo <= x[axis] <= hi, intersected with \a bounds */
+Eigen::AlignedBox3f clippedBox(const Vector3f v[3], int axis, float lo, float hi, const Eigen::AlignedBox3f& bounds)
+{
+    Eigen::AlignedBox3f box;
+    box.setNull();
+    for(int e=0; e<3; ++e)
+    {
+        const Vector3f& a = v[e];
+        const Vector3f& b = v[(e+1)%3];
+        if(a[axis]>=lo && a[axis]<=hi)
+            box.extend(a);
+        // intersections of the edge with the two planes
+        for(float plane : {lo, hi})
+        {
+            if((a[axis]<plane && b[axis]>plane) || (a[axis]>plane && b[axis]<plane))
+            {
+                Vector3f p = a + (plane-a[axis])/(b[axis]-a[axis]) * (b-a);
+                p[axis] = plane;
+                box.extend(p);
+            }
+        }
+    }
+    return box.intersection(bounds);
+}
+
+} // namespace
+
+void BVH::buildSpatial(const Mesh* pMesh, int targetCellSize, int maxDepth, float maxDuplication)
+{
+    m_pMesh = pMesh;
+    m_wideNodes.clear();
+    int n = m_pMesh->nbFaces();
+    std::vector<Reference> refs(n);
+    Eigen::AlignedBox3f rootBox;
+    rootBox.setNull();
+    for(int i=0; i<n; ++i)
+    {
+        refs[i].face = i;
+        refs[i].box.setNull();
+        for(int k=0; k<3; ++k)
+            refs[i].box.extend(m_pMesh->vertexOfFace(i, k).position);
+        rootBox.extend(refs[i].box);
+    }
+    m_rootArea = std::max(surfaceArea(rootBox), 1e-20f);
+    m_maxDuplicates = int(maxDuplication*n);
+
+    m_nodes.clear();
+    m_nodes.resize(1);
+    m_faces.clear();
+    m_faces.reserve(n + m_maxDuplicates);
+    buildSpatialNode(0, refs, 0, targetCellSize, maxDepth);
+    packTriangles();
+
+    int nbRefs = int(m_faces.size());
+    std::cout << "  SBVH: " << m_nodes.size() << " nodes, " << nbRefs-n << " duplicated references ("
+              << 100.f*float(nbRefs-n)/float(std::max(1,n)) << "%)" << std::endl;
+}
+
+void BVH::buildSpatialNode(int nodeId, std::vector<Reference>& refs, int level, int targetCellSize, int maxDepth)
+{
+    int n = int(refs.size());
+    Eigen::AlignedBox3f box, centroidBox;
+    box.setNull();
+    centroidBox.setNull();
+    for(int i=0; i<n; ++i)
+    {
+        box.extend(refs[i].box);
+        centroidBox.extend(refs[i].box.center());
+    }
+    m_nodes[nodeId].box = box;
+
+    if(n <= targetCellSize || level >= maxDepth)
+    {
+        Node& node = m_nodes[nodeId];
+        node.is_leaf = true;
+        node.first_face_id = int(m_faces.size());
+        node.nb_faces = n;
+        for(int i=0; i<n; ++i)
+            m_faces.push_back(refs[i].face);
+        return;
+    }
+
+    // 1 - best object split: SAH over buckets of the reference centroids
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1, bestSplit = 0;
+    bool spatial = false;
+    Eigen::AlignedBox3f bestLeft, bestRight;
+    int bestLeftCount = 0, bestRightCount = 0;
+    for(int axis=0; axis<3; ++axis)
+    {
+        float lo = centroidBox.min()[axis], extent = centroidBox.max()[axis]-lo;
+        if(extent<=0.f)
+            continue;
+        BucketInfo buckets[nSpatialBins];
+        for(int i=0; i<n; ++i)
+        {
+            int b = std::min(nSpatialBins-1, int(nSpatialBins*(refs[i].box.center()[axis]-lo)/extent));
+            buckets[b].count++;
+            buckets[b].bounds.extend(refs[i].box);
+        }
+        // sweep from the right, then from the left
+        Eigen::AlignedBox3f rightBoxes[nSpatialBins];
+        int rightCounts[nSpatialBins];
+        Eigen::AlignedBox3f acc;
+        acc.setNull();
+        int count = 0;
+        for(int b=nSpatialBins-1; b>0; --b)
+        {
+            if(buckets[b].count) acc.extend(buckets[b].bounds);
+            count += buckets[b].count;
+            rightBoxes[b] = acc;
+            rightCounts[b] = count;
+        }
+        acc.setNull();
+        count = 0;
+        for(int b=0; b<nSpatialBins-1; ++b)
+        {
+            if(buckets[b].count) acc.extend(buckets[b].bounds);
+            count += buckets[b].count;
+            if(count==0 || rightCounts[b+1]==0)
+                continue;
+            float cost = surfaceArea(acc)*count + surfaceArea(rightBoxes[b+1])*rightCounts[b+1];
+            if(cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+                bestLeft = acc;
+                bestRight = rightBoxes[b+1];
+                bestLeftCount = count;
+                bestRightCount = rightCounts[b+1];
+            }
+        }
+    }
+
+    // 2 - spatial splits, only worth it if the children of the object split overlap
+    float overlap = bestAxis<0 ? 1.f : surfaceArea(bestLeft.intersection(bestRight));
+    if(m_maxDuplicates>0 && overlap/m_rootArea > 1e-5f)
+    {
+        for(int axis=0; axis<3; ++axis)
+        {
+            float lo = box.min()[axis], extent = box.max()[axis]-lo;
+            if(extent<=0.f)
+                continue;
+            float binWidth = extent/nSpatialBins;
+            Eigen::AlignedBox3f bins[nSpatialBins];
+            int entries[nSpatialBins] = {0}, exits[nSpatialBins] = {0};
+            for(int b=0; b<nSpatialBins; ++b)
+                bins[b].setNull();
+            for(int i=0; i<n; ++i)
+            {
+                const Reference& ref = refs[i];
+                int b0 = std::max(0, std::min(nSpatialBins-1, int((ref.box.min()[axis]-lo)/binWidth)));
+                int b1 = std::max(b0, std::min(nSpatialBins-1, int((ref.box.max()[axis]-lo)/binWidth)));
+                entries[b0]++;
+                exits[b1]++;
+                if(b0==b1)
+                {
+                    bins[b0].extend(ref.box);
+                    continue;
+                }
+                // chop the face into the bins it spans
+                Vector3f v[3];
+                for(int k=0; k<3; ++k)
+                    v[k] = m_pMesh->vertexOfFace(ref.face, k).position;
+                for(int b=b0; b<=b1; ++b)
+                {
+                    Eigen::AlignedBox3f part = clippedBox(v, axis, lo+b*binWidth, b==nSpatialBins-1 ? box.max()[axis] : lo+(b+1)*binWidth, ref.box);
+                    if(!part.isEmpty())
+                        bins[b].extend(part);
+                }
+            }
+            Eigen::AlignedBox3f rightBoxes[nSpatialBins];
+            int rightCounts[nSpatialBins];
+            Eigen::AlignedBox3f acc;
+            acc.setNull();
+            int count = 0;
+            for(int b=nSpatialBins-1; b>0; --b)
+            {
+                acc.extend(bins[b]);
+                count += exits[b];
+                rightBoxes[b] = acc;
+                rightCounts[b] = count;
+            }
+            acc.setNull();
+            count = 0;
+            for(int b=0; b<nSpatialBins-1; ++b)
+            {
+                acc.extend(bins[b]);
+                count += entries[b];
+                if(count==0 || rightCounts[b+1]==0 || count+rightCounts[b+1]-n > m_maxDuplicates)
+                    continue;
+                float cost = surfaceArea(acc)*count + surfaceArea(rightBoxes[b+1])*rightCounts[b+1];
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                    bestLeft = acc;
+                    bestRight = rightBoxes[b+1];
+                    bestLeftCount = count;
+                    bestRightCount = rightCounts[b+1];
+                    spatial = true;
+                }
+            }
+        }
+    }
+
+    // 3 - partition the references
+    std::vector<Reference> left, right;
+    if(bestAxis>=0 && spatial)
+    {
+        float plane = box.min()[bestAxis] + (bestSplit+1)*(box.max()[bestAxis]-box.min()[bestAxis])/nSpatialBins;
+        float areaLeft = surfaceArea(bestLeft), areaRight = surfaceArea(bestRight);
+        for(int i=0; i<n; ++i)
+        {
+            const Reference& ref = refs[i];
+            if(ref.box.max()[bestAxis] <= plane)
+                left.push_back(ref);
+            else if(ref.box.min()[bestAxis] >= plane)
+                right.push_back(ref);
+            else
+            {
+                // reference unsplitting: keep the face on one side if it is cheaper than duplicating it
+                float costSplit = areaLeft*bestLeftCount + areaRight*bestRightCount;
+                float costLeft = surfaceArea(bestLeft.merged(ref.box))*bestLeftCount + areaRight*(bestRightCount-1);
+                float costRight = areaLeft*(bestLeftCount-1) + surfaceArea(bestRight.merged(ref.box))*bestRightCount;
+                Vector3f v[3];
+                for(int k=0; k<3; ++k)
+                    v[k] = m_pMesh->vertexOfFace(ref.face, k).position;
+                Reference l = ref, r = ref;
+                l.box = clippedBox(v, bestAxis, ref.box.min()[bestAxis], plane, ref.box);
+                r.box = clippedBox(v, bestAxis, plane, ref.box.max()[bestAxis], ref.box);
+                if(l.box.isEmpty() || (costRight<costSplit && costRight<=costLeft && !r.box.isEmpty()))
+                    right.push_back(ref);
+                else if(r.box.isEmpty() || costLeft<costSplit)
+                    left.push_back(ref);
+                else
+                {
+                    left.push_back(l);
+                    right.push_back(r);
+                    --m_maxDuplicates;
+                }
+            }
+        }
+    }
+    else if(bestAxis>=0)
+    {
+        float lo = centroidBox.min()[bestAxis], extent = centroidBox.max()[bestAxis]-lo;
+        for(int i=0; i<n; ++i)
+        {
+            int b = std::min(nSpatialBins-1, int(nSpatialBins*(refs[i].box.center()[bestAxis]-lo)/extent));
+            (b<=bestSplit ? left : right).push_back(refs[i]);
+        }
+    }
+
+    if(left.empty() || right.empty())
+    {
+        // all the centroids are at the same place: no useful split
+        Node& node = m_nodes[nodeId];
+        node.is_leaf = true;
+        node.first_face_id = int(m_faces.size());
+        node.nb_faces = n;
+        for(int i=0; i<n; ++i)
+            m_faces.push_back(refs[i].face);
+        return;
+    }
+    std::vector<Reference>().swap(refs);
+
+    // create the children
+    int child_id = m_nodes[nodeId].first_child_id = int(m_nodes.size());
+    m_nodes[nodeId].is_leaf = false;
+    m_nodes.resize(m_nodes.size()+2);
+    buildSpatialNode(child_id,   left,  level+1, targetCellSize, maxDepth);
+    buildSpatialNode(child_id+1, right, level+1, targetCellSize, maxDepth);
+}
+
+float BVH::sahCost() const
+{
+    if(m_nodes.empty())
+        return 0.f;
+    float cost = 0.f;
+    for(std::size_t n=0; n<m_nodes.size(); ++n)
+    {
+        const Node& node = m_nodes[n];
+        cost += surfaceArea(node.box) * (node.is_leaf ? float(node.nb_faces) : traversalCost);
+    }
+    return cost / std::max(surfaceArea(m_nodes[0].box), 1e-20f);
+}
+
+void BVH::optimize(int treeletSize, int nbIterations)
+{
+    if(m_nodes.size() < 3)
+        return;
+    treeletSize = std::max(3, std::min(maxTreeletSize, treeletSize));
+    auto t0 = std::chrono::high_resolution_clock::now();
+    float before = sahCost();
+
+    // the subtrees below stopDepth are independent, they are processed in parallel, then the top of the tree
+    int stopDepth = 0;
+    while((1<<stopDepth) < 8*nbThreads())
+        ++stopDepth;
+    std::vector<float> costs(m_nodes.size());
+    for(int it=0; it<nbIterations; ++it)
+    {
+        subtreeCost(0, costs);
+        std::vector<int> roots(1, 0), next;
+        for(int d=0; d<stopDepth; ++d)
+        {
+            next.clear();
+            for(int n : roots)
+                if(!m_nodes[n].is_leaf)
+                {
+                    next.push_back(m_nodes[n].first_child_id);
+                    next.push_back(m_nodes[n].first_child_id+1);
+                }
+            roots.swap(next);
+        }
+        parallelFor(int(roots.size()), [&](int start, int end) {
+            for(int i=start; i<end; ++i)
+                optimizeSubtree(roots[i], 0, -1, treeletSize, costs);
+        }, 1);
+        optimizeSubtree(0, 0, stopDepth, treeletSize, costs);
+    }
+
+    // collapse the subtrees cheaper as leaves, and restore the contiguity of the faces of each subtree
+    subtreeCost(0, costs);
+    NodeList nodes(1);
+    nodes.reserve(m_nodes.size());
+    std::vector<int> faces;
+    faces.reserve(m_faces.size());
+    compactNode(0, 0, costs, nodes, faces);
+    m_nodes.swap(nodes);
+    m_faces.swap(faces);
+    packTriangles();
+
+    float after = sahCost();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()-t0).count();
+    std::cout << "  BVH treelet optimization: SAH cost " << before << " -> " << after << " (" << ms << " ms)" << std::endl;
+}
+
+float BVH::subtreeCost(int nodeId, std::vector<float>& costs) const
+{
+    const Node& node = m_nodes[nodeId];
+    if(node.is_leaf)
+        costs[nodeId] = node.nb_faces * surfaceArea(node.box);
+    else
+        costs[nodeId] = traversalCost * surfaceArea(node.box)
+                      + subtreeCost(node.first_child_id, costs) + subtreeCost(node.first_child_id+1, costs);
+    return costs[nodeId];
+}
+
+void BVH::optimizeSubtree(int nodeId, int depth, int stopDepth, int treeletSize, std::vector<float>& costs)
+{
+    if(depth==stopDepth || m_nodes[nodeId].is_leaf)
+        return;
+    int child_id = m_nodes[nodeId].first_child_id;
+    optimizeSubtree(child_id,   depth+1, stopDepth, treeletSize, costs);
+    optimizeSubtree(child_id+1, depth+1, stopDepth, treeletSize, costs);
+    restructureTreelet(nodeId, treeletSize, costs);
+}
+
+bool BVH::restructureTreelet(int nodeId, int treeletSize, std::vector<float>& costs)
+{
+    // 1 - form the treelet by expanding the leaf of largest area, until it has treeletSize leaves
+    int leaves[maxTreeletSize];
+    int pairs[maxTreeletSize]; // first ids of the pairs of sibling nodes of the treelet, reused below
+    int n = 2, nbPairs = 1;
+    leaves[0] = m_nodes[nodeId].first_child_id;
+    leaves[1] = leaves[0]+1;
+    pairs[0] = leaves[0];
+    while(n < treeletSize)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for(int i=0; i<n; ++i)
+        {
+            const Node& node = m_nodes[leaves[i]];
+            float area = surfaceArea(node.box);
+            if(!node.is_leaf && area > bestArea)
+            {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if(best < 0)
+            break;
+        int child_id = m_nodes[leaves[best]].first_child_id;
+        pairs[nbPairs++] = child_id;
+        leaves[best] = child_id;
+        leaves[n++] = child_id+1;
+    }
+    if(n < 3)
+        return false;
+
+    // 2 - optimal partitions of every subset of the leaves, by increasing subsets
+    Eigen::AlignedBox3f boxes[1<<maxTreeletSize];
+    float subsetCost[1<<maxTreeletSize];
+    int partition[1<<maxTreeletSize];
+    int full = (1<<n)-1;
+    for(int s=1; s<=full; ++s)
+    {
+        int low = s & -s;
+        int i = __builtin_ctz(s);
+        if(s==low)
+        {
+            boxes[s] = m_nodes[leaves[i]].box;
+            subsetCost[s] = costs[leaves[i]];
+            continue;
+        }
+        boxes[s] = boxes[s^low].merged(m_nodes[leaves[i]].box);
+        float best = std::numeric_limits<float>::max();
+        // only the partitions where the lowest leaf is on the first side, the others are symmetric
+        for(int p=(s-1)&s; p; p=(p-1)&s)
+        {
+            if(!(p&low))
+                continue;
+            float c = subsetCost[p] + subsetCost[s^p];
+            if(c < best)
+            {
+                best = c;
+                partition[s] = p;
+            }
+        }
+        subsetCost[s] = traversalCost*surfaceArea(boxes[s]) + best;
+    }
+    if(subsetCost[full] >= costs[nodeId]*(1.f-1e-5f))
+        return false;
+
+    // 3 - rebuild the treelet with the same nodes
+    Node leafNodes[maxTreeletSize];
+    float leafCosts[maxTreeletSize];
+    for(int i=0; i<n; ++i)
+    {
+        leafNodes[i] = m_nodes[leaves[i]];
+        leafCosts[i] = costs[leaves[i]];
+    }
+    Eigen::Vector2i stack[2*maxTreeletSize]; // (subset, node id)
+    int top = 0, nextPair = 0;
+    stack[top++] = Eigen::Vector2i(full, nodeId);
+    while(top)
+    {
+        Eigen::Vector2i item = stack[--top];
+        int s = item[0];
+        Node& node = m_nodes[item[1]];
+        if((s&(s-1))==0)
+        {
+            node = leafNodes[__builtin_ctz(s)];
+            costs[item[1]] = leafCosts[__builtin_ctz(s)];
+            continue;
+        }
+        int child_id = pairs[nextPair++];
+        node.is_leaf = false;
+        node.first_child_id = child_id;
+        node.nb_faces = 0;
+        node.box = boxes[s];
+        costs[item[1]] = subsetCost[s];
+        stack[top++] = Eigen::Vector2i(partition[s], child_id);
+        stack[top++] = Eigen::Vector2i(s^partition[s], child_id+1);
+    }
+    return true;
+}
+
+void BVH::compactNode(int nodeId, int newId, const std::vector<float>& costs, NodeList& nodes, std::vector<int>& faces) const
+{
+    const Node& node = m_nodes[nodeId];
+    if(node.is_leaf)
+    {
+        nodes[newId] = node;
+        nodes[newId].first_face_id = int(faces.size());
+        faces.insert(faces.end(), m_faces.begin()+node.first_face_id, m_faces.begin()+node.first_face_id+node.nb_faces);
+        return;
+    }
+    int nbFaces = countFaces(nodeId, maxCollapsedLeafSize);
+    if(nbFaces <= maxCollapsedLeafSize && nbFaces*surfaceArea(node.box) <= costs[nodeId])
+    {
+        int first = int(faces.size());
+        std::vector<int> stack(1, nodeId);
+        while(!stack.empty())
+        {
+            const Node& n = m_nodes[stack.back()];
+            stack.pop_back();
+            if(n.is_leaf)
+                faces.insert(faces.end(), m_faces.begin()+n.first_face_id, m_faces.begin()+n.first_face_id+n.nb_faces);
+            else
+            {
+                stack.push_back(n.first_child_id+1);
+                stack.push_back(n.first_child_id);
+            }
+        }
+        Node& leaf = nodes[newId];
+        leaf.box = node.box;
+        leaf.is_leaf = true;
+        leaf.first_face_id = first;
+        leaf.nb_faces = nbFaces;
+        return;
+    }
+    int child_id = int(nodes.size());
+    nodes.resize(nodes.size()+2);
+    nodes[newId] = node;
+    nodes[newId].first_child_id = child_id;
+    compactNode(node.first_child_id,   child_id,   costs, nodes, faces);
+    compactNode(node.first_child_id+1, child_id+1, costs, nodes, faces);
+}
+
+int BVH::countFaces(int nodeId, int max) const
+{
+    const Node& node = m_nodes[nodeId];
+    if(node.is_leaf)
+        return std::min<int>(node.nb_faces, max+1);
+    int count = countFaces(node.first_child_id, max);
+    if(count <= max)
+        count += countFaces(node.first_child_id+1, max-count);
+    return std::min(count, max+1);
+}
+
+bool BVH::buildWide()
+{
+    m_wideNodes.clear();
+    m_wideFaces.clear();
+    for(std::size_t n=0; n<m_nodes.size(); ++n)
+        if(m_nodes[n].is_leaf && m_nodes[n].nb_faces > 255)
+        {
+            packTriangles();
+            return false;
+        }
+
+    m_wideNodes.reserve(m_nodes.size()/4+1);
+    m_wideFaces.reserve(m_faces.size());
+    m_wideNodes.resize(1);
+    bool ok = collapseNode(0, 0) <= maxWideDepth;
+    if(ok)
+        std::vector<WideNode>(m_wideNodes).swap(m_wideNodes);
+    else
+        m_wideNodes.clear();
+    packTriangles();
+    return ok;
+}
+
+int BVH::collapseNode(int nodeId, int wideId)
+{
+    // 1 - select up to 8 children by opening the inner child of largest area
+    int children[8];
+    int n = 0;
+    if(m_nodes[nodeId].is_leaf)
+        children[n++] = nodeId;
+    else
+    {
+        children[n++] = m_nodes[nodeId].first_child_id;
+        children[n++] = m_nodes[nodeId].first_child_id+1;
+    }
+    while(n < 8)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for(int i=0; i<n; ++i)
+        {
+            const Node& node = m_nodes[children[i]];
+            float area = surfaceArea(node.box);
+            if(!node.is_leaf && area > bestArea)
+            {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if(best < 0)
+            break;
+        int child_id = m_nodes[children[best]].first_child_id;
+        children[best] = child_id;
+        children[n++] = child_id+1;
+    }
+
+    // 2 - quantize the child boxes: 2^exponent is the smallest power of two such that the box extent fits in 255 steps
+    const Eigen::AlignedBox3f& box = m_nodes[nodeId].box;
+    WideNode wide;
+    std::fill(wide.nb_faces, wide.nb_faces+8, 0);
+    wide.inner_mask = 0;
+    float scale[3];
+    for(int k=0; k<3; ++k)
+    {
+        wide.origin[k] = box.min()[k];
+        int e;
+        std::frexp(std::max(box.max()[k]-box.min()[k], 1e-30f)/255.f, &e);
+        e = std::max(-126, std::min(127, e));
+        wide.exponent[k] = int8_t(e);
+        scale[k] = exp2i(e);
+        std::fill(wide.qmin[k], wide.qmin[k]+8, 0);
+        std::fill(wide.qmax[k], wide.qmax[k]+8, 0);
+    }
+    wide.first_child_id = int(m_wideNodes.size());
+    wide.first_face_id = int(m_wideFaces.size());
+    int nbInner = 0;
+    for(int i=0; i<n; ++i)
+    {
+        const Node& child = m_nodes[children[i]];
+        for(int k=0; k<3; ++k)
+        {
+            // rounded outwards, and checked against the decoding arithmetic so that the boxes stay conservative
+            int lo = std::max(0, std::min(255, int(std::floor((child.box.min()[k]-wide.origin[k])/scale[k]))));
+            int hi = std::max(lo, std::min(255, int(std::ceil((child.box.max()[k]-wide.origin[k])/scale[k]))));
+            while(lo>0 && wide.origin[k]+lo*scale[k] > child.box.min()[k])
+                --lo;
+            while(hi<255 && wide.origin[k]+hi*scale[k] < child.box.max()[k])
+                ++hi;
+            wide.qmin[k][i] = uint8_t(lo);
+            wide.qmax[k][i] = uint8_t(hi);
+        }
+        if(child.is_leaf)
+        {
+            wide.nb_faces[i] = uint8_t(child.nb_faces);
+            m_wideFaces.insert(m_wideFaces.end(), m_faces.begin()+child.first_face_id, m_faces.begin()+child.first_face_id+child.nb_faces);
+        }
+        else
+        {
+            wide.inner_mask |= 1<<i;
+            ++nbInner;
+        }
+    }
+    m_wideNodes[wideId] = wide;
+
+    // 3 - the inner children are consecutive
+    int first = int(m_wideNodes.size());
+    m_wideNodes.resize(m_wideNodes.size()+nbInner);
+    int depth = 0;
+    for(int i=0, j=0; i<n; ++i)
+        if(!m_nodes[children[i]].is_leaf)
+            depth = std::max(depth, collapseNode(children[i], first+j++));
+    return depth+1;
+}
+
+bool BVH::intersectWide(const Ray& ray, Hit& hit) const
+{
+    // tiny direction components instead of zeros, so that the slab distances are never NaN
+    float origin[3], invDir[3];
+    for(int k=0; k<3; ++k)
+    {
+        origin[k] = ray.origin[k];
+        float d = ray.direction[k];
+        invDir[k] = 1.f / (std::abs(d) > 1e-20f ? d : std::copysign(1e-20f, d));
+    }
+
+    // an entry is either a wide node (nb_faces == 0) or the faces of a leaf
+    struct Entry { int id; int nb_faces; float tMin; };
+    Entry stack[8*maxWideDepth];
+    int top = 0;
+    Entry entry = {0, 0, 0.f};
+    bool found = false;
+    for(;;)
+    {
+        if(entry.tMin < hit.t())
+        {
+            if(entry.nb_faces)
+                found = intersectFaces(ray, hit, entry.id, entry.nb_faces) || found;
+            else
+            {
+                const WideNode& node = m_wideNodes[entry.id];
+
+                // slab test of the 8 children at once, as Eigen packets
+                typedef Eigen::Array<float,8,1> Array8f;
+                typedef Eigen::Array<uint8_t,8,1> Array8u;
+                Array8f tMin = Array8f::Zero(), tMax = Array8f::Constant(hit.t());
+                for(int k=0; k<3; ++k)
+                {
+                    float s = exp2i(node.exponent[k])*invDir[k];
+                    float o = (node.origin[k]-origin[k])*invDir[k];
+                    Array8f t0 = o + Eigen::Map<const Array8u>(node.qmin[k]).cast<float>()*s;
+                    Array8f t1 = o + Eigen::Map<const Array8u>(node.qmax[k]).cast<float>()*s;
+                    tMin = tMin.max(t0.min(t1));
+                    tMax = tMax.min(t0.max(t1));
+                }
+                // empty slots are neither inner nodes nor leaves with faces
+                unsigned hitMask = 0;
+                for(int i=0; i<8; ++i)
+                    hitMask |= unsigned(tMin[i] <= tMax[i] && (node.nb_faces[i] || (node.inner_mask>>i & 1))) << i;
+
+                // the children hit are sorted far to near
+                Entry children[8];
+                int n = 0;
+                int childId = node.first_child_id, faceId = node.first_face_id;
+                for(int i=0; i<8; ++i)
+                {
+                    bool isInner = node.inner_mask & (1<<i);
+                    if(hitMask & (1<<i))
+                    {
+                        int j = n++;
+                        for(; j>0 && children[j-1].tMin < tMin[i]; --j)
+                            children[j] = children[j-1];
+                        children[j] = isInner ? Entry{childId, 0, tMin[i]} : Entry{faceId, node.nb_faces[i], tMin[i]};
+                    }
+                    childId += isInner;
+                    faceId += node.nb_faces[i];
+                }
+                // the closest one is processed right away, the others are pushed
+                if(n)
+                {
+                    for(int j=0; j<n-1; ++j)
+                        stack[top++] = children[j];
+                    entry = children[n-1];
+                    continue;
+                }
+            }
+        }
+        if(!top)
+            break;
+        entry = stack[--top];
+    }
+    return found;
+}
+
+bool BVH::intersects(const BVH& other, const Eigen::Affine3f& otherToThis, std::vector<Eigen::Vector2i>* pairs) const
+{
+    CollisionQuery query;
+    query.other = &other;
+    query.rotation = otherToThis.linear();
+    query.absRotation = query.rotation.cwiseAbs();
+    query.translation = otherToThis.translation();
+    query.self = false;
+    return collide(query, pairs);
+}
+
+bool BVH::selfIntersects(std::vector<Eigen::Vector2i>* pairs) const
+{
+    CollisionQuery query;
+    query.other = this;
+    query.rotation = query.absRotation = Eigen::Matrix3f::Identity();
+    query.translation = Vector3f::Zero();
+    query.self = true;
+    return collide(query, pairs);
+}
+
+bool BVH::collide(const CollisionQuery& q, std::vector<Eigen::Vector2i>* pairs) const
+{
+    if(pairs)
+        pairs->clear();
+    if(m_nodes.empty() || q.other->m_nodes.empty())
+        return false;
+    std::atomic<bool> found(false);
+    CollisionQuery query = q;
+    query.found = pairs ? 0 : &found;
+
+    // the top of the traversal, serially, then its remaining node pairs in parallel
+    std::vector<Eigen::Vector2i> roots, top;
+    collideNodes(0, 0, query, 0, collisionSplitDepth, &roots, pairs ? &top : 0);
+    std::vector<std::vector<Eigen::Vector2i> > results(pairs ? roots.size() : 0);
+    parallelFor(int(roots.size()), [&](int start, int end) {
+        for(int i=start; i<end; ++i)
+            collideNodes(roots[i][0], roots[i][1], query, collisionSplitDepth, collisionSplitDepth, 0, pairs ? &results[i] : 0);
+    }, 1);
+    if(!pairs)
+        return found;
+
+    // leaves shared by several nodes (spatial splits) and the symmetric traversal of selfIntersects() give duplicates
+    *pairs = top;
+    for(std::size_t i=0; i<results.size(); ++i)
+        pairs->insert(pairs->end(), results[i].begin(), results[i].end());
+    std::sort(pairs->begin(), pairs->end(), [](const Eigen::Vector2i& a, const Eigen::Vector2i& b) {
+        return a[0]<b[0] || (a[0]==b[0] && a[1]<b[1]);
+    });
+    pairs->erase(std::unique(pairs->begin(), pairs->end()), pairs->end());
+    return !pairs->empty();
+}
+
+void BVH::collideNodes(int nodeId, int otherId, const CollisionQuery& query, int depth, int splitDepth,
+                       std::vector<Eigen::Vector2i>* deferred, std::vector<Eigen::Vector2i>* pairs) const
+{
+    if(query.found && *query.found)
+        return;
+    if(deferred && depth>=splitDepth)
+    {
+        deferred->push_back(Eigen::Vector2i(nodeId, otherId));
+        return;
+    }
+    const Node& node = m_nodes[nodeId];
+    const Node& otherNode = query.other->m_nodes[otherId];
+
+    // a node against itself: its children against themselves and each other
+    if(query.self && nodeId==otherId)
+    {
+        if(node.is_leaf)
+        {
+            if(collideLeaves(node, node, query, pairs) && query.found)
+                *query.found = true;
+            return;
+        }
+        int c = node.first_child_id;
+        collideNodes(c, c, query, depth+1, splitDepth, deferred, pairs);
+        collideNodes(c+1, c+1, query, depth+1, splitDepth, deferred, pairs);
+        collideNodes(c, c+1, query, depth+1, splitDepth, deferred, pairs);
+        return;
+    }
+
+    // box of the other node in this space
+    Vector3f center = query.rotation * otherNode.box.center() + query.translation;
+    Vector3f half = query.absRotation * (0.5f*otherNode.box.sizes());
+    if(!node.box.intersects(Eigen::AlignedBox3f(center-half, center+half)))
+        return;
+
+    if(node.is_leaf && otherNode.is_leaf)
+    {
+        if(collideLeaves(node, otherNode, query, pairs) && query.found)
+            *query.found = true;
+    }
+    // descend into the largest node
+    else if(otherNode.is_leaf || (!node.is_leaf && surfaceArea(node.box) > surfaceArea(otherNode.box)))
+    {
+        collideNodes(node.first_child_id, otherId, query, depth+1, splitDepth, deferred, pairs);
+        collideNodes(node.first_child_id+1, otherId, query, depth+1, splitDepth, deferred, pairs);
+    }
+    else
+    {
+        collideNodes(nodeId, otherNode.first_child_id, query, depth+1, splitDepth, deferred, pairs);
+        collideNodes(nodeId, otherNode.first_child_id+1, query, depth+1, splitDepth, deferred, pairs);
+    }
+}
+
+bool BVH::collideLeaves(const Node& node, const Node& otherNode, const CollisionQuery& query, std::vector<Eigen::Vector2i>* pairs) const
+{
+    const BVH& other = *query.other;
+    bool found = false;
+    for(int i=node.first_face_id; i<node.first_face_id+node.nb_faces; i+=4)
+    {
+        // 4 faces of this leaf (degenerate triangles in the unused lanes)
+        A4 v0[3], e1[3], e2[3], p1[3], e12[3];
+        int faces[4];
+        for(int k=0; k<4; ++k)
+        {
+            faces[k] = i+k<node.first_face_id+node.nb_faces ? m_faces[i+k] : -1;
+            Vector3f a = Vector3f::Zero(), b = Vector3f::Zero(), c = Vector3f::Zero();
+            if(faces[k]>=0)
+            {
+                a = m_pMesh->vertexOfFace(faces[k], 0).position;
+                b = m_pMesh->vertexOfFace(faces[k], 1).position;
+                c = m_pMesh->vertexOfFace(faces[k], 2).position;
+            }
+            for(int d=0; d<3; ++d)
+            {
+                v0[d][k] = a[d];
+                e1[d][k] = b[d]-a[d];
+                e2[d][k] = c[d]-a[d];
+                p1[d][k] = b[d];
+                e12[d][k] = c[d]-b[d];
+            }
+        }
+
+        for(int j=otherNode.first_face_id; j<otherNode.first_face_id+otherNode.nb_faces; ++j)
+        {
+            int otherFace = other.m_faces[j];
+            Vector3f w[3];
+            for(int k=0; k<3; ++k)
+                w[k] = query.rotation * other.m_pMesh->vertexOfFace(otherFace, k).position + query.translation;
+
+            Mask4 valid;
+            for(int k=0; k<4; ++k)
+            {
+                valid[k] = faces[k]>=0;
+                if(valid[k] && query.self)
+                {
+                    // the same face, or faces sharing a vertex
+                    for(int a=0; a<3 && valid[k]; ++a)
+                        for(int b=0; b<3 && valid[k]; ++b)
+                            valid[k] = m_pMesh->vertexOfFace(faces[k], a).position != w[b];
+                }
+            }
+            if(!valid.any())
+                continue;
+
+            // the edges of the other face against the 4 faces, and the edges of the 4 faces against the other one
+            // (w0, w1, w2: the other face as origin and edges)
+            A4 wp[3][3], we[3][3], w0[3], w1[3], w2[3];
+            for(int d=0; d<3; ++d)
+            {
+                for(int k=0; k<3; ++k)
+                {
+                    wp[k][d] = A4::Constant(w[k][d]);
+                    we[k][d] = A4::Constant(w[(k+1)%3][d]-w[k][d]);
+                }
+                w0[d] = wp[0][d];
+                w1[d] = we[0][d];
+                w2[d] = A4::Constant(w[2][d]-w[0][d]);
+            }
+            Mask4 cross = segmentsCrossTriangles(wp[0], we[0], v0, e1, e2)
+                       || segmentsCrossTriangles(wp[1], we[1], v0, e1, e2)
+                       || segmentsCrossTriangles(wp[2], we[2], v0, e1, e2)
+                       || segmentsCrossTriangles(v0, e1, w0, w1, w2)
+                       || segmentsCrossTriangles(v0, e2, w0, w1, w2)
+                       || segmentsCrossTriangles(p1, e12, w0, w1, w2);
+            cross = cross && valid;
+            if(!cross.any())
+                continue;
+            found = true;
+            if(!pairs)
+                return true;
+            for(int k=0; k<4; ++k)
+            {
+                if(!cross[k])
+                    continue;
+                if(query.self)
+                    pairs->push_back(Eigen::Vector2i(std::min(faces[k], otherFace), std::max(faces[k], otherFace)));
+                else
+                    pairs->push_back(Eigen::Vector2i(faces[k], otherFace));
+            }
+        }
+    }
+    return found;
+}
+
+void BVH::packTriangles()
+{
+    const std::vector<int>& faces = m_wideNodes.empty() ? m_faces : m_wideFaces;
+    int n = int(faces.size());
+    m_blocks.resize((n+3)/4);
+    parallelFor(int(m_blocks.size()), [&](int start, int end) {
+        for(int b=start; b<end; ++b)
+        {
+            TriangleBlock& block = m_blocks[b];
+            for(int k=0; k<4; ++k)
+            {
+                int i = 4*b+k;
+                block.face[k] = i<n ? faces[i] : -1;
+                Vector3f v0 = Vector3f::Zero(), v1 = Vector3f::Zero(), v2 = Vector3f::Zero();
+                if(i<n)
+                {
+                    v0 = m_pMesh->vertexOfFace(faces[i], 0).position;
+                    v1 = m_pMesh->vertexOfFace(faces[i], 1).position;
+                    v2 = m_pMesh->vertexOfFace(faces[i], 2).position;
+                }
+                for(int c=0; c<3; ++c)
+                {
+                    block.v0[c][k] = v0[c];
+                    block.e1[c][k] = v1[c]-v0[c];
+                    block.e2[c][k] = v2[c]-v0[c];
+                }
+            }
+        }
+    }, 1024);
+}
+
+bool BVH::intersectFaces(const Ray& ray, Hit& hit, int first, int count) const
+{
+    const A4 dx(A4::Constant(ray.direction.x())), dy(A4::Constant(ray.direction.y())), dz(A4::Constant(ray.direction.z()));
+    float bestT = hit.t(), bestU = 0.f, bestV = 0.f;
+    int bestFace = -1;
+    int last = (first+count-1)/4;
+    for(int b=first/4; b<=last; ++b)
+    {
+        const TriangleBlock& tri = m_blocks[b];
+        // p = d x e2
+        A4 px = dy*tri.e2[2] - dz*tri.e2[1];
+        A4 py = dz*tri.e2[0] - dx*tri.e2[2];
+        A4 pz = dx*tri.e2[1] - dy*tri.e2[0];
+        A4 det = tri.e1[0]*px + tri.e1[1]*py + tri.e1[2]*pz;
+        A4 invDet = det.inverse();
+        A4 tx = ray.origin.x() - tri.v0[0];
+        A4 ty = ray.origin.y() - tri.v0[1];
+        A4 tz = ray.origin.z() - tri.v0[2];
+        A4 u = (tx*px + ty*py + tz*pz) * invDet;
+        // q = t x e1
+        A4 qx = ty*tri.e1[2] - tz*tri.e1[1];
+        A4 qy = tz*tri.e1[0] - tx*tri.e1[2];
+        A4 qz = tx*tri.e1[1] - ty*tri.e1[0];
+        A4 v = (dx*qx + dy*qy + dz*qz) * invDet;
+        A4 t = (tri.e2[0]*qx + tri.e2[1]*qy + tri.e2[2]*qz) * invDet;
+        // NaNs from degenerate triangles fail all the comparisons
+        auto valid = (u>=0.f) && (v>=0.f) && ((u+v)<=1.f) && (t>0.f) && (t<bestT);
+        if(!valid.any())
+            continue;
+        for(int k=0; k<4; ++k)
+        {
+            if(valid[k] && t[k]<bestT)
+            {
+                bestT = t[k];
+                bestU = u[k];
+                bestV = v[k];
+                bestFace = tri.face[k];
+            }
+        }
+    }
+    if(bestFace<0)
+        return false;
+
+    // only the closest face of the leaf is recorded, the hit is finalized by Mesh::intersect()
+    hit.setT(bestT);
+    hit.setFaceId(bestFace);
+    hit.setBaryCoords(Vector3f(bestU, bestV, 1.f-bestU-bestV));
+    return true;
+}
+
+bool BVH::closestPoint(const Point3f& p, float maxDist, Hit& hit) const
+{
+    if(m_nodes.empty())
+        return false;
+    float best = maxDist < std::numeric_limits<float>::max() ? maxDist*maxDist : maxDist;
+    int bestFace = -1;
+    Vector3f bestUVW;
+
+    // min-heap of (squared distance to the box, node)
+    typedef std::pair<float,int> Entry;
+    std::vector<Entry> heap;
+    heap.reserve(64);
+    heap.push_back(Entry(m_nodes[0].box.squaredExteriorDistance(p), 0));
+    while(!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<Entry>());
+        Entry entry = heap.back();
+        heap.pop_back();
+        if(entry.first >= best)
+            break;
+        const Node& node = m_nodes[entry.second];
+        if(node.is_leaf)
+        {
+            Vector3f uvw;
+            for(int i=node.first_face_id; i<node.first_face_id+node.nb_faces; ++i)
+            {
+                float d = m_pMesh->closestPointOnFace(p, m_faces[i], uvw);
+                if(d < best)
+                {
+                    best = d;
+                    bestFace = m_faces[i];
+                    bestUVW = uvw;
+                }
+            }
+            continue;
+        }
+        for(int c=node.first_child_id; c<node.first_child_id+2; ++c)
+        {
+            float d = m_nodes[c].box.squaredExteriorDistance(p);
+            if(d < best)
+            {
+                heap.push_back(Entry(d, c));
+                std::push_heap(heap.begin(), heap.end(), std::greater<Entry>());
+            }
+        }
+    }
+    if(bestFace < 0)
+        return false;
+    hit.setT(std::sqrt(best));
+    hit.setFaceId(bestFace);
+    hit.setBaryCoords(bestUVW);
+    return true;
+}
+
+void BVH::overlapCapsule(const Point3f& a, const Point3f& b, float radius, std::vector<Contact>& contacts) const
+{
+    if(m_nodes.empty())
+        return;
+    Eigen::AlignedBox3f box(a.cwiseMin(b), a.cwiseMax(b));
+    box.min().array() -= radius;
+    box.max().array() += radius;
+
+    // the depth of the binary tree is not bounded
+    std::vector<int> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    while(!stack.empty())
+    {
+        const Node& node = m_nodes[stack.back()];
+        stack.pop_back();
+        if(!node.box.intersects(box))
+            continue;
+        if(node.is_leaf)
+        {
+            for(int i=node.first_face_id; i<node.first_face_id+node.nb_faces; ++i)
+            {
+                Contact contact = m_pMesh->contactWithFace(a, b, radius, m_faces[i]);
+                if(contact.depth>0)
+                    contacts.push_back(contact);
+            }
+        }
+        else
+        {
+            stack.push_back(node.first_child_id);
+            stack.push_back(node.first_child_id+1);
+        }
+    }
+}
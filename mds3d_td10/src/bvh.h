@@ -4,6 +4,8 @@
 
 #include <Eigen/Geometry>
 #include <vector>
+#include <cstdint>
+#include <atomic>
 #include "ray.h"
 class Mesh;
 
@@ -20,6 +22,12 @@ class BVH
     short is_leaf = false;
   };
 
+  /** a face, or the part of a face clipped by spatial splits, see buildSpatial() */
+  struct Reference {
+      Eigen::AlignedBox3f box;
+      int face;
+  };
+
   struct BucketInfo {
       BucketInfo() { count = 0; }
       int count;
@@ -28,6 +36,43 @@ class BVH
   
   typedef std::vector<Node> NodeList;
 
+  /** 8-wide node with the boxes of its children quantized to 8 bits in the frame of its own box (Ylitie et al. 2017).
+    * Child i covers origin + [qmin,qmax] * 2^exponent. Its inner children are consecutive nodes, starting at first_child_id,
+    * and the faces of its leaf children are consecutive in m_wideFaces, starting at first_face_id.
+    */
+  struct WideNode {
+      float origin[3];
+      int8_t exponent[3];
+      uint8_t inner_mask;     // bit i is set if the child i is an inner node
+      int first_child_id;
+      int first_face_id;
+      uint8_t nb_faces[8];    // for leaf children, 0 for inner children and empty slots
+      uint8_t qmin[3][8];
+      uint8_t qmax[3][8];
+  };
+  static_assert(sizeof(WideNode) == 80, "8-wide nodes should take 80 bytes");
+
+  /** 4 consecutive faces of the face list of the leaves, in SoA layout for a SIMD ray-triangle test.
+    * Unused lanes (face -1) are degenerate triangles which are never hit.
+    */
+  struct TriangleBlock {
+      Eigen::Array4f v0[3];   // first vertex
+      Eigen::Array4f e1[3];   // v1 - v0
+      Eigen::Array4f e2[3];   // v2 - v0
+      int face[4];
+      EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  /** State of a simultaneous traversal with another tree, see intersects() */
+  struct CollisionQuery {
+      const BVH* other;
+      Eigen::Matrix3f rotation;       // from the space of other to this one
+      Eigen::Matrix3f absRotation;    // to transform the half sizes of its boxes
+      Eigen::Vector3f translation;
+      bool self;                      // other is this tree, see selfIntersects()
+      std::atomic<bool>* found;       // set on the first contact when the pairs are not collected, 0 otherwise
+  };
+
   enum SplitMethod { SPLIT_MIDDLE, SPLIT_EQUAL_COUNTS, SPLIT_SAH };
 
   static const int nBuckets = 12;
@@ -35,22 +80,162 @@ class BVH
 public:
   
   void build(const Mesh* pMesh, int targetCellSize, int maxDepth);
+
+  /** Linear BVH (Karras 2012): the faces are sorted along a 30 bits Morton curve of their centroids
+    * (parallel radix sort), the hierarchy is read from the common prefixes of the sorted codes,
+    * and the boxes are computed bottom-up in parallel. The tree has the same layout as with build(),
+    * it is built in linear time but is of lower quality: meant for geometry rebuilt at every frame.
+    */
+  void buildLinear(const Mesh* pMesh, int targetCellSize);
   bool intersect(const Ray& ray, Hit& hit) const;
+
+  /** Closest face to \a p within the distance \a maxDist: best-first traversal of the binary tree, ordered by box distance.
+    * Only the distance (as t), face and barycentric coordinates of \a hit are set, see Mesh::closestPoint() */
+  bool closestPoint(const Point3f& p, float maxDist, Hit& hit) const;
+
+  /** Appends to \a contacts the faces closer than \a radius to the segment [\a a, \a b] (a sphere if a==b).
+    * The leaves are tested against the box of the capsule. Faces referenced by several leaves (see buildSpatial())
+    * are appended once per leaf, Mesh::overlapCapsule() removes the duplicates. */
+  void overlapCapsule(const Point3f& a, const Point3f& b, float radius, std::vector<Contact>& contacts) const;
+
+  /** Intersecting faces of this mesh and of the mesh of \a other, placed in this space by \a otherToThis: simultaneous traversal
+    * of both trees, in parallel over the node pairs found down to a small depth, then a SIMD triangle-triangle test (4 faces
+    * of this mesh at once) at the leaf pairs. Triangles intersect if an edge of one of them crosses the other: coplanar
+    * overlaps are not reported. The pairs (face of this mesh, face of other) are sorted and unique.
+    * \returns true if a pair is found. If \a pairs is null, returns as soon as one is found.
+    */
+  bool intersects(const BVH& other, const Eigen::Affine3f& otherToThis, std::vector<Eigen::Vector2i>* pairs = 0) const;
+
+  /** Same as intersects() for the faces of the mesh against each others, ignoring the faces which share a vertex.
+    * The pairs are reported once, with the smallest face first. */
+  bool selfIntersects(std::vector<Eigen::Vector2i>* pairs = 0) const;
+
+  /** Collapses the binary tree into 8-wide nodes with quantized child boxes (80 bytes per node instead of 32 per binary node,
+    * and 5 to 7 times fewer nodes), which intersect() then traverses. The binary tree is kept for the other queries.
+    * Builds, refit() and setFacesInLeafOrder() drop the wide nodes: call it again after them.
+    * \returns false, leaving the binary traversal in use, if a leaf has more than 255 faces.
+    */
+  bool buildWide();
+
+  /** Spatial split BVH (Stich et al. 2009): SAH build where, besides partitioning the faces, a node can be split
+    * by a plane, the faces crossing it being clipped and referenced by both children. The boxes are then much tighter
+    * around long and thin triangles. The number of references is limited to (1+\a maxDuplication) times the number of faces.
+    * Faces can thus appear in several leaves: faceOrder() is not a permutation, and collectClusters() is meaningless.
+    */
+  void buildSpatial(const Mesh* pMesh, int targetCellSize, int maxDepth, float maxDuplication = 0.3f);
+
+  /** \returns the expected cost of a random ray traversal, relative to a ray-triangle intersection (surface area heuristic) */
+  float sahCost() const;
+
+  /** Post-build optimization (Karras and Aila 2013): every treelet of up to \a treeletSize leaves is replaced,
+    * bottom-up, by its topology of lowest SAH cost, found by dynamic programming over the subsets of its leaves.
+    * Independent subtrees are processed in parallel, and the whole pass is repeated \a nbIterations times.
+    * Subtrees are then collapsed into leaves when cheaper, so the best results are obtained from a tree with one face per leaf.
+    * Meant for static geometry, where the extra build time pays off.
+    */
+  void optimize(int treeletSize = 7, int nbIterations = 3);
+
+  /** Recomputes the node boxes bottom-up from the current vertex positions, keeping the topology.
+    * Much cheaper than build() when the mesh is deformed but its connectivity does not change.
+    */
+  void refit();
+
+  const Eigen::AlignedBox3f& boundingBox() const { return m_nodes[0].box; }
+
+  /// \returns the face ids in leaf order: the faces of any subtree are contiguous in this list
+  const std::vector<int>& faceOrder() const { return m_faces; }
+
+  /** To be called once the faces of the mesh have been permuted according to faceOrder():
+    * leaves then directly refer to the range of faces [first_face_id, first_face_id+nb_faces).
+    */
+  void setFacesInLeafOrder();
+
+  /** To be called when the faces of the mesh have been permuted: \a newIndex[i] is the new index of the face i */
+  void remapFaces(const std::vector<int>& newIndex);
+
+  /** Splits the tree into the largest subtrees having at most \a maxFaces faces.
+    * For each of them, returns its bounding box and its range (first,count) in faceOrder().
+    * Clusters are returned in leaf order, so consecutive clusters have consecutive ranges.
+    */
+  void collectClusters(int maxFaces, std::vector<Eigen::AlignedBox3f>& boxes, std::vector<Eigen::Vector2i>& ranges) const;
   
 protected:
   
   bool intersectNode(int nodeId, const Ray& ray, Hit& hit) const;
+
+  /** Tests the blocks covering the faces [first,first+count) of the leaf face list (Moller-Trumbore, 4 faces at once).
+    * Neighbouring faces outside of the range may also be tested, which is harmless. Only the distance, face and barycentric
+    * coordinates of the closest hit are written to \a hit.
+    */
+  bool intersectFaces(const Ray& ray, Hit& hit, int first, int count) const;
+
+  /** Packs the faces of the leaves into m_blocks: m_wideFaces if the wide nodes are built, m_faces otherwise.
+    * Called after anything changing the face lists or the positions (builds, refit(), buildWide()...).
+    */
+  void packTriangles();
+
+  /** Traversal of the node pair (\a nodeId of this tree, \a otherId of the other one), see intersects().
+    * Below the depth \a splitDepth, the pairs are pushed to \a deferred instead, if not null. */
+  void collideNodes(int nodeId, int otherId, const CollisionQuery& query, int depth, int splitDepth,
+                    std::vector<Eigen::Vector2i>* deferred, std::vector<Eigen::Vector2i>* pairs) const;
+
+  /** Triangle-triangle tests between the faces of two leaves, see intersects(). \returns true if a pair is found */
+  bool collideLeaves(const Node& node, const Node& otherNode, const CollisionQuery& query, std::vector<Eigen::Vector2i>* pairs) const;
+
+  /** Collects the contacts of the node pairs of \a query, see intersects() and selfIntersects() */
+  bool collide(const CollisionQuery& query, std::vector<Eigen::Vector2i>* pairs) const;
+
+  /** Stack based traversal of the 8-wide nodes, see buildWide() */
+  bool intersectWide(const Ray& ray, Hit& hit) const;
+
+  /** Fills the wide node \a wideId from the binary node \a nodeId, and recursively its children. \returns the depth of the subtree */
+  int collapseNode(int nodeId, int wideId);
   
   int split(int start, int end, int dim, float split_value);
+
+  void subtreeRange(int nodeId, int& start, int& end) const;
+  void collectClusters(int nodeId, int maxFaces, std::vector<Eigen::AlignedBox3f>& boxes, std::vector<Eigen::Vector2i>& ranges) const;
   
   void buildNode(int nodeId, int start, int end, int level, int targetCellSize, int maxDepth);
 
+  /** Builds the node \a nodeId of a spatial split BVH from \a refs (which is consumed) */
+  void buildSpatialNode(int nodeId, std::vector<Reference>& refs, int level, int targetCellSize, int maxDepth);
+
+  /** Creates the node \a nodeId from the node \a id of the radix tree (a leaf if \a isLeaf), see buildLinear() */
+  void emitLinearNode(int nodeId, int id, bool isLeaf, int targetCellSize,
+                      const std::vector<Eigen::Vector2i>& children, const std::vector<Eigen::Vector2i>& ranges,
+                      std::vector<int>& parents);
+
+  /** Computes the SAH cost of every node of the subtree \a nodeId in \a costs, see optimize() */
+  float subtreeCost(int nodeId, std::vector<float>& costs) const;
+
+  /** Optimizes, bottom-up, the treelets rooted in the subtree \a nodeId down to the depth \a stopDepth (excluded) */
+  void optimizeSubtree(int nodeId, int depth, int stopDepth, int treeletSize, std::vector<float>& costs);
+
+  /** Replaces the treelet rooted at \a nodeId by its optimal topology, reusing its nodes. \returns false if it is unchanged */
+  bool restructureTreelet(int nodeId, int treeletSize, std::vector<float>& costs);
+
+  /** Copies the subtree \a nodeId in \a nodes (at \a newId) and its faces in \a faces, in depth-first order.
+    * Subtrees cheaper as a single leaf according to \a costs are collapsed, see optimize() */
+  void compactNode(int nodeId, int newId, const std::vector<float>& costs, NodeList& nodes, std::vector<int>& faces) const;
+
+  /** \returns the number of faces of the subtree \a nodeId, or \a max+1 if it has more than \a max faces */
+  int countFaces(int nodeId, int max) const;
+
+  /** Computes the boxes of all the nodes bottom-up, in parallel: \a parents[i] is the parent of the node i (-1 for the root) */
+  void computeBoxes(const std::vector<int>& parents);
+
   const Mesh* m_pMesh;
   NodeList m_nodes;
   std::vector<int> m_faces;
   std::vector<Point3f> m_centroids;
+  std::vector<WideNode> m_wideNodes;
+  std::vector<int> m_wideFaces;
+  std::vector<TriangleBlock, Eigen::aligned_allocator<TriangleBlock> > m_blocks;
 
   SplitMethod m_splitMethod;
+  float m_rootArea;     ///< surface area of the root box, see buildSpatial()
+  int m_maxDuplicates;  ///< remaining number of references buildSpatial() can add
   BucketInfo m_buckets[nBuckets];
   
 };
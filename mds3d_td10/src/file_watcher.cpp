@@ -0,0 +1,91 @@
+#include "file_watcher.h"
+
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+FileWatcher::FileWatcher()
+    : mFd(-1), mStop(false)
+{}
+
+FileWatcher::~FileWatcher()
+{
+    stop();
+}
+
+bool FileWatcher::watch(const std::string& directory)
+{
+    stop();
+#ifdef __linux__
+    mFd = inotify_init1(IN_NONBLOCK);
+    if(mFd<0)
+        return false;
+    // editors either rewrite the file in place or move a temporary file over it
+    if(inotify_add_watch(mFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO)<0)
+    {
+        std::cerr << "FileWatcher: cannot watch " << directory << std::endl;
+        close(mFd);
+        mFd = -1;
+        return false;
+    }
+    mDirectory = directory;
+    mStop = false;
+    mThread = std::thread(&FileWatcher::run, this);
+    return true;
+#else
+    (void)directory;
+    return false;
+#endif
+}
+
+void FileWatcher::stop()
+{
+    mStop = true;
+    if(mThread.joinable())
+        mThread.join();
+#ifdef __linux__
+    if(mFd>=0)
+        close(mFd);
+#endif
+    mFd = -1;
+}
+
+std::set<std::string> FileWatcher::changedFiles()
+{
+    std::set<std::string> files;
+    std::lock_guard<std::mutex> lock(mMutex);
+    files.swap(mChanged);
+    return files;
+}
+
+void FileWatcher::run()
+{
+#ifdef __linux__
+    alignas(inotify_event) char buffer[4096];
+    pollfd pfd;
+    pfd.fd = mFd;
+    pfd.events = POLLIN;
+    while(!mStop)
+    {
+        // wake up regularly to check the stop flag
+        if(poll(&pfd, 1, 100)<=0)
+            continue;
+        ssize_t len;
+        while((len = read(mFd, buffer, sizeof(buffer)))>0)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            for(char* p=buffer; p<buffer+len; )
+            {
+                const inotify_event* event = (const inotify_event*)p;
+                if(event->len>0)
+                    mChanged.insert(mDirectory + "/" + event->name);
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+#endif
+}
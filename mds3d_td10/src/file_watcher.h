@@ -0,0 +1,41 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+/** Watches a directory from a background thread and records the files which have been
+  * written to, so that the render thread can reload them without polling the file system.
+  * Only implemented on Linux (inotify); elsewhere watch() fails and nothing is reported.
+  */
+class FileWatcher
+{
+public:
+    FileWatcher();
+    ~FileWatcher();
+
+    /** Starts watching the files of \a directory (not recursive).
+        \return false if the directory cannot be watched */
+    bool watch(const std::string& directory);
+
+    /** Stops the background thread */
+    void stop();
+
+    /** \returns the full paths of the files modified since the last call, and clears the list */
+    std::set<std::string> changedFiles();
+
+private:
+    void run();
+
+    std::string mDirectory;
+    int mFd;
+    std::thread mThread;
+    std::atomic<bool> mStop;
+    std::mutex mMutex;
+    std::set<std::string> mChanged;
+};
+
+#endif // FILE_WATCHER_H
@@ -0,0 +1,168 @@
+#include "frame_capture.h"
+#include "SOIL2.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+FrameCapture::FrameCapture()
+    : mWidth(0), mHeight(0), mFrame(0), mStopEncoder(false)
+{}
+
+FrameCapture::~FrameCapture()
+{
+    stop();
+}
+
+bool FrameCapture::start(const std::string& output, int width, int height)
+{
+    stop();
+
+    mOutput = output;
+    if(output.size()>4 && output.compare(output.size()-4, 4, ".rgb")==0)
+    {
+        mVideo.open(output.c_str(), std::ios::out | std::ios::binary);
+        if(!mVideo)
+        {
+            std::cerr << "FrameCapture: cannot create " << output << std::endl;
+            return false;
+        }
+    }
+
+    mWidth = width;
+    mHeight = height;
+    mFrame = 0;
+    glGenBuffers(RING_SIZE, mPBOs);
+    for(int i=0; i<RING_SIZE; ++i)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, mPBOs[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, width*height*4, 0, GL_STREAM_READ);
+        mFences[i] = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    mStopEncoder = false;
+    mEncoder = std::thread(&FrameCapture::encode, this);
+    std::cout << "Capturing " << width << "x" << height << " frames to " << output << std::endl;
+    return true;
+}
+
+void FrameCapture::capture()
+{
+    if(!isCapturing())
+        return;
+    int slot = mFrame % RING_SIZE;
+    // the PBO still holds the frame captured RING_SIZE frames ago
+    if(mFrame>=RING_SIZE)
+        retrieve(mFrame-RING_SIZE);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, mPBOs[slot]);
+    glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    mFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, UnusedMask::GL_NONE_BIT);
+    ++mFrame;
+}
+
+void FrameCapture::retrieve(int frame)
+{
+    int slot = frame % RING_SIZE;
+    // usually already signaled, since the copy was issued a few frames ago
+    glClientWaitSync(mFences[slot], SyncObjectMask::GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+    glDeleteSync(mFences[slot]);
+    mFences[slot] = 0;
+
+    std::vector<unsigned char> pixels;
+    {
+        // the encoder is late: wait, rather than dropping frames or growing the queue forever
+        std::unique_lock<std::mutex> lock(mMutex);
+        mFrameDone.wait(lock, [this]() { return mQueue.size()<MAX_QUEUED_FRAMES; });
+        if(!mFreeBuffers.empty())
+        {
+            pixels.swap(mFreeBuffers.back());
+            mFreeBuffers.pop_back();
+        }
+    }
+    pixels.resize(mWidth*mHeight*4);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, mPBOs[slot]);
+    const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pixels.size(), GL_MAP_READ_BIT);
+    if(data)
+        std::memcpy(pixels.data(), data, pixels.size());
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueue.push_back(Frame());
+    mQueue.back().index = frame;
+    mQueue.back().pixels.swap(pixels);
+    mFrameReady.notify_one();
+}
+
+void FrameCapture::stop()
+{
+    if(!isCapturing())
+        return;
+    for(int frame=std::max(0, mFrame-RING_SIZE); frame<mFrame; ++frame)
+        retrieve(frame);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopEncoder = true;
+        mFrameReady.notify_one();
+    }
+    mEncoder.join();
+    glDeleteBuffers(RING_SIZE, mPBOs);
+    if(mVideo.is_open())
+        mVideo.close();
+    mFreeBuffers.clear();
+    std::cout << "Captured " << mFrame << " frames" << std::endl;
+    mWidth = mHeight = 0;
+}
+
+void FrameCapture::encode()
+{
+    std::vector<unsigned char> rgb(mWidth*mHeight*3);
+    while(true)
+    {
+        Frame frame;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mFrameReady.wait(lock, [this]() { return !mQueue.empty() || mStopEncoder; });
+            if(mQueue.empty())
+                return;
+            frame.index = mQueue.front().index;
+            frame.pixels.swap(mQueue.front().pixels);
+            mQueue.pop_front();
+        }
+        mFrameDone.notify_one();
+
+        // RGBA bottom-up to RGB top-down
+        for(int y=0; y<mHeight; ++y)
+        {
+            const unsigned char* src = &frame.pixels[(mHeight-1-y)*mWidth*4];
+            unsigned char* dst = &rgb[y*mWidth*3];
+            for(int x=0; x<mWidth; ++x)
+            {
+                dst[3*x+0] = src[4*x+0];
+                dst[3*x+1] = src[4*x+1];
+                dst[3*x+2] = src[4*x+2];
+            }
+        }
+
+        if(mVideo.is_open())
+        {
+            mVideo.write((const char*)rgb.data(), rgb.size());
+        }
+        else
+        {
+            char filename[32];
+            std::sprintf(filename, "/frame_%05d.png", frame.index);
+            if(!SOIL_save_image((mOutput + filename).c_str(), SOIL_SAVE_TYPE_PNG, mWidth, mHeight, 3, rgb.data()))
+                std::cerr << "FrameCapture: cannot write " << mOutput + filename << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFreeBuffers.push_back(std::vector<unsigned char>());
+        mFreeBuffers.back().swap(frame.pixels);
+    }
+}
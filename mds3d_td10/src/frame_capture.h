@@ -0,0 +1,69 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include "opengl.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Captures the rendered frames without stalling the rendering.
+  *
+  * Each frame is read into one of a ring of pixel buffer objects (an asynchronous copy on the GPU side),
+  * and mapped a few frames later, when the copy is done. The pixels are then written by a background
+  * thread, either as a sequence of PNG files or as a single raw RGB24 video stream
+  * (e.g., \c ffmpeg \c -f \c rawvideo \c -pix_fmt \c rgb24 \c -s \c WxH \c -r \c 30 \c -i \c capture.rgb).
+  */
+class FrameCapture
+{
+public:
+    FrameCapture();
+    ~FrameCapture();
+
+    /** Starts capturing frames of size \a width x \a height.
+      * If \a output ends with ".rgb", the frames are appended to this raw video file,
+      * otherwise they are saved as \a output/frame_XXXXX.png
+      * \return false if the output cannot be created */
+    bool start(const std::string& output, int width, int height);
+
+    /** Reads the current read framebuffer (e.g., the back buffer before swapping). Does not block. */
+    void capture();
+
+    /** Writes the pending frames and waits for the encoder to finish */
+    void stop();
+
+    bool isCapturing() const { return mWidth>0; }
+
+private:
+    enum { RING_SIZE = 3, MAX_QUEUED_FRAMES = 16 };
+
+    /** maps the PBO of the frame \a frame, and passes its pixels to the encoder */
+    void retrieve(int frame);
+    void encode();
+
+    int mWidth, mHeight;
+    int mFrame; ///< number of captured frames
+    GLuint mPBOs[RING_SIZE];
+    GLsync mFences[RING_SIZE];
+
+    // encoder thread
+    struct Frame
+    {
+        int index;
+        std::vector<unsigned char> pixels; ///< RGBA, bottom-up
+    };
+    std::string mOutput;
+    std::ofstream mVideo;
+    std::thread mEncoder;
+    std::mutex mMutex;
+    std::condition_variable mFrameReady, mFrameDone;
+    std::deque<Frame> mQueue;
+    std::vector< std::vector<unsigned char> > mFreeBuffers; ///< recycled pixel buffers
+    bool mStopEncoder;
+};
+
+#endif // FRAME_CAPTURE_H
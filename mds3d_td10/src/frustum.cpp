@@ -0,0 +1,69 @@
+#include "frustum.h"
+
+using namespace Eigen;
+
+void Frustum::setFromMatrix(const Matrix4f& mat)
+{
+    // Gribb & Hartmann: -w <= x,y,z <= w
+    mPlanes.row(0) = mat.row(3) + mat.row(0); // left
+    mPlanes.row(1) = mat.row(3) - mat.row(0); // right
+    mPlanes.row(2) = mat.row(3) + mat.row(1); // bottom
+    mPlanes.row(3) = mat.row(3) - mat.row(1); // top
+    mPlanes.row(4) = mat.row(3) + mat.row(2); // near
+    mPlanes.row(5) = mat.row(3) - mat.row(2); // far
+}
+
+bool Frustum::intersects(const AlignedBox3f& box) const
+{
+    if(box.isEmpty())
+        return false;
+    Vector3f c = box.center();
+    Vector3f e = 0.5f*box.sizes();
+    for(int i=0; i<6; ++i)
+    {
+        // signed distance of the center vs projected radius of the box
+        float d = mPlanes.row(i).head<3>().dot(c) + mPlanes(i,3);
+        float r = mPlanes.row(i).head<3>().cwiseAbs().dot(e);
+        if(d < -r)
+            return false;
+    }
+    return true;
+}
+
+int Frustum::intersects(const AlignedBox3f* boxes, int n, unsigned char* visible) const
+{
+    int count = 0;
+    int i = 0;
+    for(; i+4<=n; i+=4)
+    {
+        // SoA centers and half-extents of 4 boxes
+        Array4f cx, cy, cz, ex, ey, ez;
+        for(int k=0; k<4; ++k)
+        {
+            Vector3f c = boxes[i+k].center();
+            Vector3f e = 0.5f*boxes[i+k].sizes();
+            cx[k] = c.x(); cy[k] = c.y(); cz[k] = c.z();
+            ex[k] = e.x(); ey[k] = e.y(); ez[k] = e.z();
+        }
+        Array4f inside = Array4f::Ones();
+        for(int p=0; p<6; ++p)
+        {
+            const float a = mPlanes(p,0), b = mPlanes(p,1), c = mPlanes(p,2), d = mPlanes(p,3);
+            Array4f dist = a*cx + b*cy + c*cz + d;
+            Array4f radius = std::abs(a)*ex + std::abs(b)*ey + std::abs(c)*ez;
+            inside = (dist < -radius).select(Array4f::Zero(), inside);
+        }
+        for(int k=0; k<4; ++k)
+        {
+            visible[i+k] = inside[k]>0 && !boxes[i+k].isEmpty();
+            count += visible[i+k];
+        }
+    }
+    // remainder
+    for(; i<n; ++i)
+    {
+        visible[i] = intersects(boxes[i]);
+        count += visible[i];
+    }
+    return count;
+}
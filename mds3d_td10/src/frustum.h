@@ -0,0 +1,49 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <Eigen/Geometry>
+#include <vector>
+
+/** View frustum represented by its 6 planes, used to cull bounding boxes.
+    Example:
+    \code
+    Frustum f(cam.projectionMatrix() * cam.viewMatrix() * M); // planes in object space of M
+    if(f.intersects(mesh.boundingBox()))
+      mesh.draw(shader);
+    \endcode
+*/
+class Frustum
+{
+public:
+    Frustum() { mPlanes.setZero(); }
+
+    /** Extracts the planes from a clip-space transformation, e.g., proj*view (world space) or proj*view*obj (object space) */
+    explicit Frustum(const Eigen::Matrix4f& mat) { setFromMatrix(mat); }
+
+    void setFromMatrix(const Eigen::Matrix4f& mat);
+
+    /** \returns false if the box is fully outside the frustum (conservative test) */
+    bool intersects(const Eigen::AlignedBox3f& box) const;
+
+    /** Tests \a n boxes at once, 4 boxes per SIMD packet, and writes the result in \a visible.
+      * \returns the number of visible boxes
+      */
+    int intersects(const Eigen::AlignedBox3f* boxes, int n, unsigned char* visible) const;
+
+private:
+    /** one plane (a,b,c,d) per row, a point p is inside if a*x+b*y+c*z+d >= 0 for all planes */
+    Eigen::Matrix<float,6,4> mPlanes;
+};
+
+/** Per-frame culling counters */
+struct CullingStats
+{
+    CullingStats() { reset(); }
+    void reset() { objectsVisible = objectsCulled = clustersVisible = clustersCulled = triangles = 0; }
+
+    int objectsVisible, objectsCulled;
+    int clustersVisible, clustersCulled;
+    int triangles; ///< number of triangles actually sent to OpenGL
+};
+
+#endif // FRUSTUM_H
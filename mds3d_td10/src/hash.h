@@ -0,0 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <string>
+
+/** \returns the 64 bits FNV-1a hash of \a key: fast and well distributed, to name cache files (not cryptographic) */
+inline unsigned long long hashString(const std::string& key)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for(std::size_t i=0; i<key.size(); ++i)
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    return hash;
+}
+
+#endif // HASH_H
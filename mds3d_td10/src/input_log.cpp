@@ -0,0 +1,45 @@
+#include "input_log.h"
+
+#include <cstring>
+#include <iostream>
+
+namespace {
+const char logMagic[4] = {'I','N','P','L'};
+const int logVersion = 1;
+}
+
+bool InputRecorder::open(const std::string& filename)
+{
+    mOut.open(filename.c_str(), std::ios::out | std::ios::binary);
+    if(!mOut)
+    {
+        std::cerr << "InputRecorder: cannot create " << filename << std::endl;
+        return false;
+    }
+    mOut.write(logMagic, 4);
+    mOut.write((const char*)&logVersion, sizeof(logVersion));
+    return true;
+}
+
+void InputRecorder::record(const InputEvent& event)
+{
+    mOut.write((const char*)&event, sizeof(InputEvent));
+}
+
+bool loadInputLog(const std::string& filename, std::vector<InputEvent>& events)
+{
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    char magic[4];
+    int version;
+    if(!in.read(magic, 4) || std::memcmp(magic, logMagic, 4)!=0
+       || !in.read((char*)&version, sizeof(version)) || version!=logVersion)
+    {
+        std::cerr << "loadInputLog: " << filename << " is not a valid input log" << std::endl;
+        return false;
+    }
+    events.clear();
+    InputEvent event;
+    while(in.read((char*)&event, sizeof(InputEvent)))
+        events.push_back(event);
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef INPUT_LOG_H
+#define INPUT_LOG_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+/** An input event dispatched to the Viewer, or the rendering of a frame.
+  * Stored as is (28 bytes) in the input logs. */
+struct InputEvent
+{
+    enum Type { FRAME, KEY, CHAR, MOUSE_BUTTON, CURSOR_POS, SCROLL, RESHAPE };
+
+    InputEvent(Type t = FRAME, float time = 0.f, int a = 0, int b = 0, int c = 0, float x = 0.f, float y = 0.f)
+      : time(time), type(int(t)), x(x), y(y)
+    {
+        args[0] = a; args[1] = b; args[2] = c;
+    }
+
+    float time;   ///< in seconds since the beginning of the recording
+    int type;
+    int args[3];  ///< key/button, action, mods, or the integer coordinates
+    float x, y;   ///< scroll offsets
+};
+
+/** Writes the input events to a binary file as they arrive, so that a session can be replayed (see loadInputLog()) */
+class InputRecorder
+{
+public:
+    /** \return false if \a filename cannot be created */
+    bool open(const std::string& filename);
+    bool isOpen() const { return mOut.is_open(); }
+
+    void record(const InputEvent& event);
+
+private:
+    std::ofstream mOut;
+};
+
+/** Reads the events written by an InputRecorder
+  * \return false if \a filename is not a valid input log */
+bool loadInputLog(const std::string& filename, std::vector<InputEvent>& events);
+
+#endif // INPUT_LOG_H
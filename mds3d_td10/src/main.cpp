@@ -1,6 +1,12 @@
 #include "opengl.h"
 #include "viewer.h"
+#include "benchmark.h"
+#include "input_log.h"
+#include "frame_capture.h"
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 Viewer* v;
 
 int WIDTH = 600;
@@ -8,14 +14,47 @@ int HEIGHT = 600;
 
 int g_pixel_ratio = 1;
 
-static void char_callback(GLFWwindow* /*window*/, unsigned int key)
+InputRecorder g_recorder;
+FrameCapture g_capture;
+bool g_replaying = false; // live inputs are ignored during a replay
+double g_startTime = 0;
+
+// all the inputs reach the viewer through this function, so that they can be recorded and replayed
+static void dispatch(GLFWwindow* window, const InputEvent& e)
+{
+    if (g_recorder.isOpen())
+        g_recorder.record(e);
+
+    switch (e.type) {
+    case InputEvent::KEY:          v->keyPressed(e.args[0], e.args[1], e.args[2]); break;
+    case InputEvent::CHAR:         v->charPressed(e.args[0]); break;
+    case InputEvent::MOUSE_BUTTON: v->mousePressed(window, e.args[0], e.args[1], e.args[2]); break;
+    case InputEvent::CURSOR_POS:   v->mouseMoved(e.args[0], e.args[1]); break;
+    case InputEvent::SCROLL:       v->mouseScroll(e.x, e.y); break;
+    case InputEvent::RESHAPE:      v->reshape(e.args[0], e.args[1]); break;
+    case InputEvent::FRAME:
+        v->updateAndDrawScene();
+        g_capture.capture();
+        glfwSwapBuffers(window);
+        break;
+    }
+}
+
+static float eventTime()
 {
-    v->charPressed(key);
+    return float(glfwGetTime() - g_startTime);
 }
 
-static void scroll_callback(GLFWwindow* /*window*/, double x, double y)
+static void char_callback(GLFWwindow* window, unsigned int key)
 {
-    v->mouseScroll(x,y);
+    if (!g_replaying)
+        dispatch(window, InputEvent(InputEvent::CHAR, eventTime(), int(key)));
+}
+
+static void scroll_callback(GLFWwindow* window, double x, double y)
+{
+    if (!g_replaying)
+        dispatch(window, InputEvent(InputEvent::SCROLL, eventTime(), 0, 0, 0, float(x), float(y)));
 }
 
 static void key_callback(GLFWwindow* window, int key, int /*scancode*/, int action, int mods)
@@ -24,32 +63,82 @@ static void key_callback(GLFWwindow* window, int key, int /*scancode*/, int acti
         glfwSetWindowShouldClose(window, true);
     }
 
-    v->keyPressed(key,action,mods);
+    if (!g_replaying)
+        dispatch(window, InputEvent(InputEvent::KEY, eventTime(), key, action, mods));
 }
 
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 {
-    v->mousePressed(window, button, action, mods);
+    if (!g_replaying)
+        dispatch(window, InputEvent(InputEvent::MOUSE_BUTTON, eventTime(), button, action, mods));
 }
 
-void cursorPos_callback(GLFWwindow* /*window*/, double x, double y)
+void cursorPos_callback(GLFWwindow* window, double x, double y)
 {
-    v->mouseMoved(x*g_pixel_ratio,y*g_pixel_ratio);
+    if (!g_replaying)
+        dispatch(window, InputEvent(InputEvent::CURSOR_POS, eventTime(), int(x*g_pixel_ratio), int(y*g_pixel_ratio)));
 }
 
 void reshape_callback(GLFWwindow* window, int width, int height)
 {
-    v->reshape(width,height);
-    v->updateAndDrawScene();
-    glfwSwapBuffers(window);
+    if (g_replaying)
+        return;
+    dispatch(window, InputEvent(InputEvent::RESHAPE, eventTime(), width, height));
+    dispatch(window, InputEvent(InputEvent::FRAME, eventTime()));
+}
+
+// replays the events of \a filename, at the recorded pace or as fast as possible,
+// and prints the time taken by each frame
+static bool replay(GLFWwindow* window, const std::string& filename, bool fast)
+{
+    std::vector<InputEvent> events;
+    if (!loadInputLog(filename, events))
+        return false;
+
+    g_replaying = true;
+    std::vector<double> frameTimes;
+    double start = glfwGetTime();
+    for (std::size_t i=0; i<events.size() && !glfwWindowShouldClose(window); ++i)
+    {
+        const InputEvent& e = events[i];
+        while (!fast && glfwGetTime()-start < e.time)
+            glfwPollEvents();
+
+        if (e.type == InputEvent::FRAME)
+        {
+            double t = glfwGetTime();
+            v->updateAndDrawScene();
+            glFinish();
+            frameTimes.push_back((glfwGetTime()-t)*1000.);
+            g_capture.capture();
+            glfwSwapBuffers(window);
+            std::cout << "frame " << frameTimes.size() << ": " << frameTimes.back() << " ms\n";
+        }
+        else
+        {
+            dispatch(window, e);
+        }
+        glfwPollEvents();
+    }
+    g_replaying = false;
+
+    std::cout << "Replay of " << filename << ": " << frameTimes.size() << " frames in "
+              << glfwGetTime()-start << " s" << std::endl;
+    printFrameStats("frame", frameTimes);
+    return true;
 }
 
-// initialize GLFW framework
-GLFWwindow* initGLFW()
+// initialize GLFW framework, the window is not shown in \a headless mode
+GLFWwindow* initGLFW(bool headless, bool egl)
 {
     if (!glfwInit())
         exit(EXIT_FAILURE);
 
+    if (headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    if (egl)
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, (GLint)GL_TRUE);
@@ -88,16 +177,85 @@ static void error_callback(int /*error*/, const char* description)
 }
 
 
-int main (int /*argc*/, char **/*argv*/)
+static void usage(const char* program)
+{
+    std::cout << "usage: " << program << " [--headless [--frames N] [--size WxH] [--png DIR] [--egl]]\n"
+              << "       " << program << " [--record FILE | --replay FILE [--fast]] [--capture OUT]\n"
+              << "  --headless  renders N frames (300 by default) along a camera path in a hidden window,\n"
+              << "              prints the frame times and exits\n"
+              << "  --png DIR   saves the frames in DIR\n"
+              << "  --egl       creates the context with EGL instead of GLX/WGL/NSGL\n"
+              << "  --record    saves all the inputs and frames of the session in FILE\n"
+              << "  --replay    replays a recorded session and prints the frame times,\n"
+              << "              at the recorded pace or as fast as possible with --fast\n"
+              << "  --capture   saves the frames as OUT/frame_XXXXX.png, or as raw RGB24 video if OUT ends with .rgb" << std::endl;
+}
+
+int main (int argc, char **argv)
 {
+    bool headless = false, egl = false, fast = false;
+    std::string recordFile, replayFile, captureOutput;
+    BenchmarkOptions benchmark;
+    for (int i=1; i<argc; ++i)
+    {
+        if (!strcmp(argv[i], "--headless"))
+            headless = true;
+        else if (!strcmp(argv[i], "--egl"))
+            egl = true;
+        else if (!strcmp(argv[i], "--frames") && i+1<argc)
+            benchmark.nbFrames = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--size") && i+1<argc && sscanf(argv[i+1], "%dx%d", &WIDTH, &HEIGHT)==2)
+            ++i;
+        else if (!strcmp(argv[i], "--record") && i+1<argc)
+            recordFile = argv[++i];
+        else if (!strcmp(argv[i], "--replay") && i+1<argc)
+            replayFile = argv[++i];
+        else if (!strcmp(argv[i], "--capture") && i+1<argc)
+            captureOutput = argv[++i];
+        else if (!strcmp(argv[i], "--fast"))
+            fast = true;
+        else if (!strcmp(argv[i], "--png") && i+1<argc)
+            benchmark.pngDir = argv[++i];
+        else {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     glfwSetErrorCallback(error_callback);
 
-    GLFWwindow* window = initGLFW();
+    GLFWwindow* window = initGLFW(headless, egl);
     int w, h;
     glfwGetFramebufferSize(window, &w, &h);
     v = new Viewer();
     v->init(w,h);
 
+    if (headless)
+    {
+        bool ok = runBenchmark(*v, w, h, benchmark);
+        delete v;
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (!captureOutput.empty() && !g_capture.start(captureOutput, w, h))
+        exit(EXIT_FAILURE);
+
+    if (!replayFile.empty())
+    {
+        bool ok = replay(window, replayFile, fast);
+        g_capture.stop();
+        delete v;
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    g_startTime = glfwGetTime();
+    if (!recordFile.empty() && g_recorder.open(recordFile))
+        dispatch(window, InputEvent(InputEvent::RESHAPE, 0.f, w, h)); // replays start from the same viewport
+
     double t0 = glfwGetTime();
     double t1 = t0;
     while (!glfwWindowShouldClose(window))
@@ -105,13 +263,13 @@ int main (int /*argc*/, char **/*argv*/)
         // render the scene
         t1 = glfwGetTime();
         if((t1-t0)>0.03) {
-            v->updateAndDrawScene();
-            glfwSwapBuffers(window);
+            dispatch(window, InputEvent(InputEvent::FRAME, eventTime()));
             t0 = t1;
         }
         glfwPollEvents();
     }
 
+    g_capture.stop();
     delete v;
 
     glfwDestroyWindow(window);
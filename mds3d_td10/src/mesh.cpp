@@ -1,5 +1,9 @@
 #include "mesh.h"
 #include "bvh.h"
+#include "parallel.h"
+#include "frustum.h"
+#include "simplification.h"
+#include "vertex_cache.h"
 
 #include <iostream>
 #include <fstream>
@@ -8,16 +12,74 @@
 #include "shader.h"
 #include <Eigen/Geometry>
 #include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 
 using namespace std;
 using namespace Eigen;
 
+namespace {
+
+/** meshes from which ray queries use the 8-wide BVH nodes, see BVH::buildWide() */
+const int wideBVHMinFaces = 1<<16;
+
+/** Closest points \a c1 of [p1,q1] and \a c2 of [p2,q2], \returns their squared distance
+  * (Ericson, Real-Time Collision Detection, 5.1.9) */
+float closestPointsOfSegments(const Vector3f& p1, const Vector3f& q1, const Vector3f& p2, const Vector3f& q2,
+                              Vector3f& c1, Vector3f& c2)
+{
+    const float eps = 1e-12f;
+    Vector3f d1 = q1-p1, d2 = q2-p2, r = p1-p2;
+    float a = d1.squaredNorm(), e = d2.squaredNorm(), f = d2.dot(r);
+    float s, t;
+    if(a<=eps && e<=eps)
+        s = t = 0;
+    else if(a<=eps)
+    {
+        s = 0;
+        t = std::min(std::max(f/e, 0.f), 1.f);
+    }
+    else
+    {
+        float c = d1.dot(r);
+        if(e<=eps)
+        {
+            t = 0;
+            s = std::min(std::max(-c/a, 0.f), 1.f);
+        }
+        else
+        {
+            float b = d1.dot(d2), denom = a*e - b*b;
+            s = denom>0 ? std::min(std::max((b*f - c*e)/denom, 0.f), 1.f) : 0.f;
+            t = (b*s + f)/e;
+            if(t<0)
+            {
+                t = 0;
+                s = std::min(std::max(-c/a, 0.f), 1.f);
+            }
+            else if(t>1)
+            {
+                t = 1;
+                s = std::min(std::max((b-c)/a, 0.f), 1.f);
+            }
+        }
+    }
+    c1 = p1 + s*d1;
+    c2 = p2 + t*d2;
+    return (c1-c2).squaredNorm();
+}
+
+} // namespace
+
 Mesh::~Mesh()
 {
   if(mIsInitialized)
   {
     glDeleteBuffers(1,&mVertexBufferId);
     glDeleteBuffers(1,&mIndexBufferId);
+    if(!mLODIndexBufferIds.empty())
+      glDeleteBuffers(GLsizei(mLODIndexBufferIds.size()),mLODIndexBufferIds.data());
     glDeleteVertexArrays(1,&mVertexArrayId);
   }
 }
@@ -38,10 +100,20 @@ bool Mesh::load(const std::string& filename)
 }
 
 void Mesh::init()
+{
+    prepare();
+    upload();
+}
+
+void Mesh::prepare()
 {
     updateBoundingBox();
     updateBVH();
+    optimizeIndices();
+}
 
+void Mesh::upload()
+{
     glGenVertexArrays(1,&mVertexArrayId);
     glGenBuffers(1,&mVertexBufferId);
     glGenBuffers(1,&mIndexBufferId);
@@ -83,76 +155,223 @@ void Mesh::updateVBO()
   // activate the VBO:
   glBindBuffer(GL_ARRAY_BUFFER, mVertexBufferId);
   // copy the data from host's RAM to GPU's video memory:
-  glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex)*mVertices.size(), mVertices[0].position.data(), GL_STATIC_DRAW);
+  if(mVertexFormat==VF_QUANTIZED)
+  {
+    std::vector<QuantizedVertex> vertices;
+    quantizeVertices(vertices);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(QuantizedVertex)*vertices.size(), vertices.data(), GL_STATIC_DRAW);
+  }
+  else
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex)*mVertices.size(), mVertices[0].position.data(), GL_STATIC_DRAW);
 
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBufferId);
   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Vector3i)*mFaces.size(), mFaces[0].data(), GL_STATIC_DRAW);
 
+  // simplified levels
+  if(mLODIndexBufferIds.size()!=mLODFaces.size())
+  {
+    if(!mLODIndexBufferIds.empty())
+      glDeleteBuffers(GLsizei(mLODIndexBufferIds.size()),mLODIndexBufferIds.data());
+    mLODIndexBufferIds.resize(mLODFaces.size());
+    if(!mLODIndexBufferIds.empty())
+      glGenBuffers(GLsizei(mLODIndexBufferIds.size()),mLODIndexBufferIds.data());
+  }
+  for(std::size_t l=0; l<mLODFaces.size(); ++l)
+  {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mLODIndexBufferIds[l]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Vector3i)*mLODFaces[l].size(), mLODFaces[l][0].data(), GL_STATIC_DRAW);
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBufferId);
 
+  setupVertexArray();
 }
 
 
-void Mesh::draw(const Shader& shd)
+void Mesh::draw(const Shader& shd, const Frustum* frustum, CullingStats* stats, int lod)
+{
+    bind(shd);
+    drawBound(frustum, stats, lod);
+}
+
+void Mesh::bind(const Shader& shd)
 {
     if (!mIsInitialized)
       init();
 
-      // Activate the VBO of the current mesh:
+  // the attribute pointers are stored in the vertex array (see setupVertexArray())
   glBindVertexArray(mVertexArrayId);
-  glBindBuffer(GL_ARRAY_BUFFER, mVertexBufferId);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBufferId);
 
-  // Specify vertex data
+  // decoding parameters of the positions and normals
+  bool quantized = mVertexFormat==VF_QUANTIZED;
+  Vector3f offset = Vector3f::Zero(), scale = Vector3f::Ones();
+  if(quantized)
+  {
+    offset = mQuantizationBox.min();
+    scale = mQuantizationBox.sizes();
+  }
+  int offset_loc = shd.getUniformLocation("pos_offset");
+  if(offset_loc>=0) glUniform3fv(offset_loc, 1, offset.data());
+  int scale_loc = shd.getUniformLocation("pos_scale");
+  if(scale_loc>=0) glUniform3fv(scale_loc, 1, scale.data());
+  int oct_loc = shd.getUniformLocation("oct_normals");
+  if(oct_loc>=0) glUniform1i(oct_loc, quantized);
+}
+
+int Mesh::drawBound(const Frustum* frustum, CullingStats* stats, int lod)
+{
+  lod = std::max(0, std::min(lod, nbLODs()-1));
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lod==0 ? mIndexBufferId : mLODIndexBufferIds[lod-1]);
+
+  int nbDrawCalls = 0;
+  // send the geometry
+  if(lod>0)
+  {
+    // clusters only apply to the original faces
+    glDrawElements(GL_TRIANGLES, 3*mLODFaces[lod-1].size(), GL_UNSIGNED_INT, 0);
+    ++nbDrawCalls;
+    if(stats)
+      stats->triangles += int(mLODFaces[lod-1].size());
+  }
+  else if(frustum && !mClusterBoxes.empty())
+  {
+    int nbClusters = int(mClusterBoxes.size());
+    mClusterVisible.resize(nbClusters);
+    int nbVisible = frustum->intersects(mClusterBoxes.data(), nbClusters, mClusterVisible.data());
+    if(stats)
+    {
+      stats->clustersVisible += nbVisible;
+      stats->clustersCulled += nbClusters-nbVisible;
+    }
+    // clusters are sorted: merge consecutive visible clusters into a single draw call
+    for(int i=0; i<nbClusters; )
+    {
+      if(!mClusterVisible[i]) { ++i; continue; }
+      int first = mClusterRanges[i][0], count = 0;
+      for(; i<nbClusters && mClusterVisible[i]; ++i)
+        count += mClusterRanges[i][1];
+      glDrawElements(GL_TRIANGLES, 3*count, GL_UNSIGNED_INT, (void*)(sizeof(Vector3i)*first));
+      ++nbDrawCalls;
+      if(stats)
+        stats->triangles += count;
+    }
+  }
+  else
+  {
+    glDrawElements(GL_TRIANGLES, 3*mFaces.size(), GL_UNSIGNED_INT, 0);
+    ++nbDrawCalls;
+    if(stats)
+      stats->triangles += nbFaces();
+  }
+
+  // at this point the mesh has been drawn and raserized into the framebuffer!
+  checkError();
+  return nbDrawCalls;
+}
 
-  // 1 - get id of the attribute "vtx_position" as declared as "in vec3 vtx_position" in the vertex shader
-  int vertex_loc = shd.getAttribLocation("vtx_position");
-  if(vertex_loc>=0)
+void Mesh::setupVertexArray()
+{
+  // the vertex array must be bound: it records the attribute pointers below,
+  // and the standard attribute locations are the same in all the shaders
+  if(mVertexFormat==VF_QUANTIZED)
+  {
+    glVertexAttribPointer(Shader::ATTRIB_POSITION, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(QuantizedVertex), 0);
+    glVertexAttribPointer(Shader::ATTRIB_NORMAL, 2, GL_SHORT, GL_TRUE, sizeof(QuantizedVertex), (void*)offsetof(QuantizedVertex, normal));
+    glVertexAttribPointer(Shader::ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(QuantizedVertex), (void*)offsetof(QuantizedVertex, color));
+    glVertexAttribPointer(Shader::ATTRIB_TEXCOORD, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(QuantizedVertex), (void*)offsetof(QuantizedVertex, texcoord));
+  }
+  else
   {
-    // 2 - tells OpenGL where to find the x, y, and z coefficients:
-    glVertexAttribPointer(vertex_loc,     // id of the attribute
+    // tells OpenGL where to find the x, y, and z coefficients of the positions:
+    glVertexAttribPointer(Shader::ATTRIB_POSITION, // id of the attribute
                           3,              // number of coefficients (here 3 for x, y, z)
                           GL_FLOAT,       // type of the coefficients (here float)
                           GL_FALSE,       // for fixed-point number types only
                           sizeof(Vertex), // number of bytes between the x coefficient of two vertices
                                           // (e.g. number of bytes between x_0 and x_1)
                           0);             // number of bytes to get x_0
-    // 3 - activate this stream of vertex attribute
-    glEnableVertexAttribArray(vertex_loc);
+    glVertexAttribPointer(Shader::ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)sizeof(Vector3f));
+    glVertexAttribPointer(Shader::ATTRIB_COLOR, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(2*sizeof(Vector3f)));
+    glVertexAttribPointer(Shader::ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(2*sizeof(Vector3f)+sizeof(Vector4f)));
   }
+  // activate these streams of vertex attributes
+  glEnableVertexAttribArray(Shader::ATTRIB_POSITION);
+  glEnableVertexAttribArray(Shader::ATTRIB_NORMAL);
+  glEnableVertexAttribArray(Shader::ATTRIB_COLOR);
+  glEnableVertexAttribArray(Shader::ATTRIB_TEXCOORD);
+}
 
-  int normal_loc = shd.getAttribLocation("vtx_normal");
-  if(normal_loc>=0)
-  {
-    glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)sizeof(Vector3f));
-    glEnableVertexAttribArray(normal_loc);
-  }
 
-  int color_loc = shd.getAttribLocation("vtx_color");
-  if(color_loc>=0)
-  {
-    glVertexAttribPointer(color_loc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(2*sizeof(Vector3f)));
-    glEnableVertexAttribArray(color_loc);
-  }
+namespace {
 
-  int texcoord_loc = shd.getAttribLocation("vtx_texcoord");
-  if(texcoord_loc>=0)
-  {
-    glVertexAttribPointer(texcoord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(2*sizeof(Vector3f)+sizeof(Vector4f)));
-    glEnableVertexAttribArray(texcoord_loc);
-  }
+Vector2f octEncode(Vector3f n)
+{
+  n /= n.cwiseAbs().sum();
+  Vector2f p = n.head<2>();
+  if(n.z() < 0)
+    p = Vector2f((1.f-std::abs(p.y())) * (p.x()>=0 ? 1.f : -1.f),
+                 (1.f-std::abs(p.x())) * (p.y()>=0 ? 1.f : -1.f));
+  return p;
+}
 
-  // send the geometry
-  glDrawElements(GL_TRIANGLES, 3*mFaces.size(), GL_UNSIGNED_INT, 0);
+Vector3f octDecode(const Vector2f& p)
+{
+  Vector3f n(p.x(), p.y(), 1.f - std::abs(p.x()) - std::abs(p.y()));
+  if(n.z() < 0)
+    n.head<2>() = Vector2f((1.f-std::abs(p.y())) * (p.x()>=0 ? 1.f : -1.f),
+                           (1.f-std::abs(p.x())) * (p.y()>=0 ? 1.f : -1.f));
+  return n.normalized();
+}
 
-  // at this point the mesh has been drawn and raserized into the framebuffer!
-  if(vertex_loc>=0)   glDisableVertexAttribArray(vertex_loc);
-  if(normal_loc>=0)   glDisableVertexAttribArray(normal_loc);
-  if(color_loc>=0)    glDisableVertexAttribArray(color_loc);
-  if(texcoord_loc>=0) glDisableVertexAttribArray(texcoord_loc);
+template<typename T> T quantize(float x, float maxValue)
+{
+  return T(std::floor(x*maxValue + 0.5f));
+}
 
-  checkError();
 }
 
+void Mesh::quantizeVertices(std::vector<QuantizedVertex>& vertices)
+{
+  updateBoundingBox();
+  mQuantizationBox = mBBox;
+  Vector3f offset = mBBox.min();
+  Vector3f scale = mBBox.sizes().cwiseMax(Vector3f::Constant(1e-20f));
+
+  float maxPosError = 0, maxNormalError = 0;
+  vertices.resize(mVertices.size());
+  for(std::size_t i=0; i<mVertices.size(); ++i)
+  {
+    const Vertex& v = mVertices[i];
+    QuantizedVertex& q = vertices[i];
+
+    Vector3f p = (v.position-offset).cwiseQuotient(scale).cwiseMax(0.f).cwiseMin(1.f);
+    for(int k=0; k<3; ++k)
+      q.position[k] = quantize<unsigned short>(p[k], 65535.f);
+    q.position[3] = 0;
+    Vector3f decodedPos = offset + scale.cwiseProduct(Vector3f(q.position[0], q.position[1], q.position[2])/65535.f);
+    maxPosError = std::max(maxPosError, (decodedPos-v.position).norm());
+
+    if(v.normal.squaredNorm()>0)
+    {
+      Vector2f e = octEncode(v.normal);
+      q.normal[0] = quantize<short>(e.x(), 32767.f);
+      q.normal[1] = quantize<short>(e.y(), 32767.f);
+      Vector3f decodedNormal = octDecode(Vector2f(q.normal[0], q.normal[1])/32767.f);
+      maxNormalError = std::max(maxNormalError, std::acos(std::min(1.f, decodedNormal.dot(v.normal.normalized()))));
+    }
+    else
+      q.normal[0] = q.normal[1] = 0;
+
+    for(int k=0; k<4; ++k)
+      q.color[k] = quantize<unsigned char>(std::max(0.f, std::min(1.f, v.color[k])), 255.f);
+
+    for(int k=0; k<2; ++k)
+      q.texcoord[k] = Eigen::half(v.texcoord[k]).x;
+  }
+
+  std::cout << "  quantized vertices: " << sizeof(QuantizedVertex) << " bytes/vertex (instead of " << sizeof(Vertex)
+            << "), max errors: position " << maxPosError << " (" << 100.f*maxPosError/mBBox.diagonal().norm()
+            << "% of the diagonal), normal " << maxNormalError*180.f/float(M_PI) << " deg" << std::endl;
+}
 
 void Mesh::updateBoundingBox()
 {
@@ -166,7 +385,68 @@ void Mesh::updateBVH()
     if(mBVH)
       delete mBVH;
     mBVH = new BVH;
-    mBVH->build(this, 10, 100);
+    if(mOptimizeBVH)
+    {
+        // the treelet optimization works best from one face per leaf, and fixes the poor splits of the Morton tree
+        mBVH->buildLinear(this, 1);
+        mBVH->optimize();
+    }
+    else
+        mBVH->build(this, 10, 100);
+
+    // Reorder the faces so that each BVH subtree is a contiguous range of the index buffer,
+    // large meshes are then split into clusters that can be culled independently.
+    const std::vector<int>& order = mBVH->faceOrder();
+    std::vector<Vector3i> faces(mFaces.size());
+    for(std::size_t i=0; i<mFaces.size(); ++i)
+        faces[i] = mFaces[order[i]];
+    mFaces.swap(faces);
+    mBVH->setFacesInLeafOrder();
+
+    const int clusterSize = 512;
+    if(nbFaces() > 4*clusterSize)
+        mBVH->collectClusters(clusterSize, mClusterBoxes, mClusterRanges);
+    else
+    {
+        mClusterBoxes.clear();
+        mClusterRanges.clear();
+    }
+
+    // The clusters stay those of the regular BVH, the spatial split one is only used for ray queries.
+    if(mBVHSpatialSplits > 0.f)
+    {
+        BVH* spatial = new BVH;
+        spatial->buildSpatial(this, mOptimizeBVH ? 1 : 10, 100, mBVHSpatialSplits);
+        if(mOptimizeBVH)
+            spatial->optimize();
+        float before = mBVH->sahCost(), after = spatial->sahCost();
+        std::cout << "  BVH SAH cost: " << before << " -> " << after << " with spatial splits" << std::endl;
+        if(after < before)
+            std::swap(mBVH, spatial);
+        delete spatial;
+    }
+
+    // ray queries on large meshes traverse the compact 8-wide nodes, small trees stay in cache anyway
+    if(nbFaces() >= wideBVHMinFaces)
+        mBVH->buildWide();
+
+    if(mIsInitialized)
+        updateVBO();
+}
+
+void Mesh::updateClusterBoxes()
+{
+    parallelFor(int(mClusterRanges.size()), [this](int start, int end) {
+        for(int c=start; c<end; ++c)
+        {
+            Eigen::AlignedBox3f& box = mClusterBoxes[c];
+            box.setNull();
+            int first = mClusterRanges[c][0], last = first + mClusterRanges[c][1];
+            for(int i=first; i<last; ++i)
+                for(int k=0; k<3; ++k)
+                    box.extend(mVertices[mFaces[i][k]].position);
+        }
+    }, 4);
 }
 
 
@@ -184,11 +464,8 @@ bool Mesh::intersectFace(const Ray& ray, Hit& hit, int faceId) const
     if(t>0 && u>=0 && v>=0 && (u+v)<=1 && t<hit.t())
     {
         hit.setT(t);
-
         hit.setFaceId(faceId);
         hit.setBaryCoords(Vector3f(u,v,1.-u-v));
-        hit.setIntersectionPoint(u*v0+v*v1+(1.f-u-v)*v2);
-
         return true;
     }
     return false;
@@ -196,15 +473,15 @@ bool Mesh::intersectFace(const Ray& ray, Hit& hit, int faceId) const
 
 bool Mesh::intersect(const Ray& ray, Hit& hit) const
 {
+    bool found = false;
     if(mBVH)
     {
         // use the BVH !!
-        return mBVH->intersect(ray, hit);
+        found = mBVH->intersect(ray, hit);
     }
     else
     {
         // brute force !!
-        bool ret = false;
         float tMin, tMax;
         Normal3f normal;
         if( (!::intersect(ray, mBBox, tMin, tMax,normal)) || tMin>hit.t())
@@ -212,12 +489,405 @@ bool Mesh::intersect(const Ray& ray, Hit& hit) const
 
         for(int i=0; i<nbFaces(); ++i)
         {
-            ret = ret | intersectFace(ray, hit, i);
+            found = found | intersectFace(ray, hit, i);
+        }
+    }
+    if(found)
+        finalizeHit(hit);
+    return found;
+}
+
+bool Mesh::closestPoint(const Point3f& p, float maxDist, Hit& hit) const
+{
+    bool found = false;
+    if(mBVH)
+        found = mBVH->closestPoint(p, maxDist, hit);
+    else
+    {
+        // brute force !!
+        float best = maxDist < std::numeric_limits<float>::max() ? maxDist*maxDist : maxDist;
+        Vector3f uvw;
+        for(int i=0; i<nbFaces(); ++i)
+        {
+            float d = closestPointOnFace(p, i, uvw);
+            if(d < best)
+            {
+                best = d;
+                hit.setT(std::sqrt(d));
+                hit.setFaceId(i);
+                hit.setBaryCoords(uvw);
+                found = true;
+            }
+        }
+    }
+    if(found)
+        finalizeHit(hit);
+    return found;
+}
+
+void Mesh::closestPoints(const std::vector<Point3f>& points, float maxDist, std::vector<Hit>& hits) const
+{
+    hits.assign(points.size(), Hit());
+    parallelFor(int(points.size()), [&](int start, int end) {
+        for(int i=start; i<end; ++i)
+            closestPoint(points[i], maxDist, hits[i]);
+    }, 64);
+}
+
+float Mesh::closestPointOnFace(const Point3f& p, int faceId, Vector3f& uvw) const
+{
+    // Ericson, Real-Time Collision Detection, 5.1.5: find the Voronoi region of p
+    const Vector3f& a = vertexOfFace(faceId, 0).position;
+    const Vector3f& b = vertexOfFace(faceId, 1).position;
+    const Vector3f& c = vertexOfFace(faceId, 2).position;
+    Vector3f ab = b-a, ac = c-a, ap = p-a;
+    float d1 = ab.dot(ap), d2 = ac.dot(ap);
+    float v, w; // weights of b and c
+    if(d1<=0 && d2<=0)
+        v = w = 0;                                          // vertex a
+    else
+    {
+        Vector3f bp = p-b;
+        float d3 = ab.dot(bp), d4 = ac.dot(bp);
+        Vector3f cp = p-c;
+        float d5 = ab.dot(cp), d6 = ac.dot(cp);
+        float vc = d1*d4 - d3*d2, vb = d5*d2 - d1*d6, va = d3*d6 - d5*d4;
+        if(d3>=0 && d4<=d3)
+        {
+            v = 1; w = 0;                                   // vertex b
+        }
+        else if(vc<=0 && d1>=0 && d3<=0)
+        {
+            v = d1/(d1-d3); w = 0;                          // edge ab
+        }
+        else if(d6>=0 && d5<=d6)
+        {
+            v = 0; w = 1;                                   // vertex c
+        }
+        else if(vb<=0 && d2>=0 && d6<=0)
+        {
+            v = 0; w = d2/(d2-d6);                          // edge ac
+        }
+        else if(va<=0 && (d4-d3)>=0 && (d5-d6)>=0)
+        {
+            w = (d4-d3)/((d4-d3)+(d5-d6)); v = 1-w;         // edge bc
+        }
+        else
+        {
+            float denom = 1.f/(va+vb+vc);                   // inside the face
+            v = vb*denom;
+            w = vc*denom;
+        }
+    }
+    uvw = Vector3f(v, w, 1.f-v-w);
+    return (a + v*ab + w*ac - p).squaredNorm();
+}
+
+bool Mesh::intersects(const Mesh& other, const Eigen::Affine3f& otherToThis, std::vector<Eigen::Vector2i>* pairs) const
+{
+    if(pairs)
+        pairs->clear();
+    if(!mBVH || !other.mBVH)
+        return false;
+    return mBVH->intersects(*other.mBVH, otherToThis, pairs);
+}
+
+bool Mesh::selfIntersects(std::vector<Eigen::Vector2i>* pairs) const
+{
+    if(pairs)
+        pairs->clear();
+    if(!mBVH)
+        return false;
+    return mBVH->selfIntersects(pairs);
+}
+
+float Mesh::closestPointsOnFace(const Point3f& a, const Point3f& b, int faceId, Point3f& onFace, Point3f& onSegment) const
+{
+    const Vector3f& v0 = vertexOfFace(faceId, 0).position;
+    const Vector3f& v1 = vertexOfFace(faceId, 1).position;
+    const Vector3f& v2 = vertexOfFace(faceId, 2).position;
+
+    // a segment crossing the plane inside the face
+    Vector3f n = (v1-v0).cross(v2-v0);
+    float da = n.dot(a-v0), db = n.dot(b-v0);
+    if(da*db<=0 && da!=db)
+    {
+        Point3f x = a + da/(da-db)*(b-a);
+        if(n.dot((v1-v0).cross(x-v0))>=0 && n.dot((v2-v1).cross(x-v1))>=0 && n.dot((v0-v2).cross(x-v2))>=0)
+        {
+            onFace = onSegment = x;
+            return 0;
+        }
+    }
+
+    // otherwise the closest points are on the boundary of one of them: the end points or the edges
+    Vector3f uvw;
+    float best = closestPointOnFace(a, faceId, uvw);
+    onFace = uvw[2]*v0 + uvw[0]*v1 + uvw[1]*v2;
+    onSegment = a;
+    if(b!=a)
+    {
+        float d = closestPointOnFace(b, faceId, uvw);
+        if(d<best)
+        {
+            best = d;
+            onFace = uvw[2]*v0 + uvw[0]*v1 + uvw[1]*v2;
+            onSegment = b;
+        }
+        const Vector3f* edges[3][2] = {{&v0, &v1}, {&v1, &v2}, {&v2, &v0}};
+        Vector3f cs, cf;
+        for(int k=0; k<3; ++k)
+        {
+            d = closestPointsOfSegments(a, b, *edges[k][0], *edges[k][1], cs, cf);
+            if(d<best)
+            {
+                best = d;
+                onFace = cf;
+                onSegment = cs;
+            }
+        }
+    }
+    return best;
+}
+
+Contact Mesh::contactWithFace(const Point3f& a, const Point3f& b, float radius, int faceId) const
+{
+    Contact contact;
+    contact.faceId = faceId;
+    Point3f onSegment;
+    float dist = std::sqrt(closestPointsOnFace(a, b, faceId, contact.point, onSegment));
+    if(dist>1e-6f)
+    {
+        contact.normal = (onSegment-contact.point)/dist;
+        contact.depth = radius-dist;
+        return contact;
+    }
+
+    // the axis crosses the face: push towards its front side (the outside of a closed mesh),
+    // far enough for the end point behind it to clear the plane
+    const Vector3f& v0 = vertexOfFace(faceId, 0).position;
+    Normal3f n = (vertexOfFace(faceId, 1).position-v0).cross(vertexOfFace(faceId, 2).position-v0).normalized();
+    contact.normal = n;
+    contact.depth = radius + std::max(0.f, -std::min(n.dot(a-v0), n.dot(b-v0)));
+    return contact;
+}
+
+bool Mesh::overlapCapsule(const Point3f& a, const Point3f& b, float radius, std::vector<Contact>& contacts) const
+{
+    contacts.clear();
+    if(mBVH)
+    {
+        mBVH->overlapCapsule(a, b, radius, contacts);
+        // a spatial split BVH references some faces in several leaves
+        std::sort(contacts.begin(), contacts.end(), [](const Contact& c0, const Contact& c1) { return c0.faceId<c1.faceId; });
+        contacts.erase(std::unique(contacts.begin(), contacts.end(),
+                                   [](const Contact& c0, const Contact& c1) { return c0.faceId==c1.faceId; }), contacts.end());
+    }
+    else
+    {
+        // brute force !!
+        for(int i=0; i<nbFaces(); ++i)
+        {
+            Contact contact = contactWithFace(a, b, radius, i);
+            if(contact.depth>0)
+                contacts.push_back(contact);
+        }
+    }
+    return !contacts.empty();
+}
+
+void Mesh::finalizeHit(Hit& hit) const
+{
+    // the barycentric coordinates (u,v,w) are the weights of the vertices 1, 2 and 0
+    const Vector3f& uvw = hit.baryCoords();
+    const Vertex& v0 = vertexOfFace(hit.faceId(), 0);
+    const Vertex& v1 = vertexOfFace(hit.faceId(), 1);
+    const Vertex& v2 = vertexOfFace(hit.faceId(), 2);
+    hit.setIntersectionPoint(uvw[2]*v0.position + uvw[0]*v1.position + uvw[1]*v2.position);
+    hit.setNormal((uvw[2]*v0.normal + uvw[0]*v1.normal + uvw[1]*v2.normal).normalized());
+    hit.setShape(this);
+}
+
+void Mesh::buildLODs(int nbLevels, float ratio)
+{
+    std::vector<Vector3f> positions(mVertices.size()), normals(mVertices.size());
+    for(std::size_t i=0; i<mVertices.size(); ++i)
+    {
+        positions[i] = mVertices[i].position;
+        normals[i] = mVertices[i].normal;
+    }
+    buildLODChain(positions, normals, mFaces, nbLevels, ratio, mLODFaces);
+    mLODRatio = ratio;
+
+    std::cout << "  LODs:";
+    for(std::size_t l=0; l<mLODFaces.size(); ++l)
+        std::cout << " " << mLODFaces[l].size();
+    std::cout << " faces (original " << mFaces.size() << ")" << std::endl;
+}
+
+void Mesh::optimizeIndices()
+{
+    if(mFaces.empty())
+        return;
+    float acmrBefore = computeACMR(mFaces.data(), nbFaces());
+
+    // 1 - triangle order, within each cluster so that their ranges remain valid
+    std::vector<Eigen::Vector2i> ranges = mClusterRanges;
+    if(ranges.empty())
+        ranges.push_back(Eigen::Vector2i(0, nbFaces()));
+    std::vector<Vector3i> faces(mFaces.size());
+    std::vector<int> newFaceIndex(mFaces.size());
+    std::vector<int> order;
+    // the vertices of each cluster are renumbered from 0, so that the cost of optimizeFaceOrder() only depends on the cluster
+    std::vector<int> localIndex(mVertices.size(), -1), clusterVertices;
+    std::vector<Vector3i> localFaces;
+    for(std::size_t c=0; c<ranges.size(); ++c)
+    {
+        int first = ranges[c][0];
+        localFaces.resize(ranges[c][1]);
+        clusterVertices.clear();
+        for(int f=0; f<ranges[c][1]; ++f)
+            for(int k=0; k<3; ++k)
+            {
+                int& v = localIndex[mFaces[first+f][k]];
+                if(v<0)
+                {
+                    v = int(clusterVertices.size());
+                    clusterVertices.push_back(mFaces[first+f][k]);
+                }
+                localFaces[f][k] = v;
+            }
+        for(std::size_t i=0; i<clusterVertices.size(); ++i)
+            localIndex[clusterVertices[i]] = -1;
+        optimizeFaceOrder(localFaces.data(), ranges[c][1], int(clusterVertices.size()), order);
+        for(std::size_t i=0; i<order.size(); ++i)
+        {
+            faces[first+i] = mFaces[first+order[i]];
+            newFaceIndex[first+order[i]] = first+int(i);
+        }
+    }
+    mFaces.swap(faces);
+    if(mBVH)
+        mBVH->remapFaces(newFaceIndex);
+
+    for(std::size_t l=0; l<mLODFaces.size(); ++l)
+    {
+        optimizeFaceOrder(mLODFaces[l].data(), int(mLODFaces[l].size()), nbVertices(), order);
+        faces.resize(order.size());
+        for(std::size_t i=0; i<order.size(); ++i)
+            faces[i] = mLODFaces[l][order[i]];
+        mLODFaces[l].swap(faces);
+    }
+
+    // 2 - vertex order
+    std::vector<int> remap;
+    computeVertexFetchRemap(mFaces, nbVertices(), remap);
+    std::vector<Vertex> vertices(mVertices.size());
+    for(std::size_t i=0; i<mVertices.size(); ++i)
+        vertices[remap[i]] = mVertices[i];
+    mVertices.swap(vertices);
+    for(std::size_t f=0; f<mFaces.size(); ++f)
+        for(int k=0; k<3; ++k)
+            mFaces[f][k] = remap[mFaces[f][k]];
+    for(std::size_t l=0; l<mLODFaces.size(); ++l)
+        for(std::size_t f=0; f<mLODFaces[l].size(); ++f)
+            for(int k=0; k<3; ++k)
+                mLODFaces[l][f][k] = remap[mLODFaces[l][f][k]];
+    if(isSkinned())
+    {
+        std::vector<Vector3f> restPositions(mRestPositions.size()), restNormals(mRestNormals.size());
+        std::vector<Vector4i> boneIds(mBoneIds.size());
+        std::vector<Weights4f> boneWeights(mBoneWeights.size());
+        for(std::size_t i=0; i<remap.size(); ++i)
+        {
+            restPositions[remap[i]] = mRestPositions[i];
+            restNormals[remap[i]] = mRestNormals[i];
+            boneIds[remap[i]] = mBoneIds[i];
+            boneWeights[remap[i]] = mBoneWeights[i];
         }
-        return ret;
+        mRestPositions.swap(restPositions);
+        mRestNormals.swap(restNormals);
+        mBoneIds.swap(boneIds);
+        mBoneWeights.swap(boneWeights);
+    }
+
+    std::cout << "  ACMR: " << acmrBefore << " -> " << computeACMR(mFaces.data(), nbFaces()) << std::endl;
+}
+
+int Mesh::selectLOD(float screenSize, float fullDetailSize) const
+{
+    if(mLODFaces.empty() || screenSize >= fullDetailSize)
+        return 0;
+    if(screenSize <= 0)
+        return nbLODs()-1;
+    // the number of faces should decrease as the covered area, i.e., as screenSize^2
+    float level = std::log((screenSize*screenSize)/(fullDetailSize*fullDetailSize)) / std::log(mLODRatio);
+    return std::min(int(level), nbLODs()-1);
+}
+
+
+//********************************************************************************
+// CPU skinning
+//********************************************************************************
+
+void Mesh::setSkinning(const std::vector<Vector4i>& boneIds, const std::vector<Weights4f>& boneWeights)
+{
+    assert(boneIds.size()==mVertices.size() && boneWeights.size()==mVertices.size());
+    mBoneIds = boneIds;
+    mBoneWeights = boneWeights;
+    mRestPositions.resize(mVertices.size());
+    mRestNormals.resize(mVertices.size());
+    for(std::size_t i=0; i<mVertices.size(); ++i)
+    {
+        mRestPositions[i] = mVertices[i].position;
+        mRestNormals[i] = mVertices[i].normal;
     }
+    mSkinDirty = !mBones.empty();
+}
+
+void Mesh::setBoneTransforms(const BoneList& bones)
+{
+    mBones = bones;
+    mSkinDirty = isSkinned();
 }
 
+void Mesh::updateSkinning()
+{
+    if(!mSkinDirty)
+        return;
+    mSkinDirty = false;
+
+    parallelFor(int(mVertices.size()), [this](int start, int end) {
+        for(int i=start; i<end; ++i)
+        {
+            const Vector4i& ids = mBoneIds[i];
+            const Weights4f& w = mBoneWeights[i];
+            // linear blend of the 3x4 matrices: 12 floats, i.e., 3 SIMD packets per bone
+            Matrix34f B = w[0]*mBones[ids[0]];
+            for(int k=1; k<4; ++k)
+                if(w[k]!=0.f)
+                    B += w[k]*mBones[ids[k]];
+            mVertices[i].position = B.leftCols<3>()*mRestPositions[i] + B.col(3);
+            mVertices[i].normal = (B.leftCols<3>()*mRestNormals[i]).normalized();
+        }
+    }, 4096);
+
+    if(mBVH)
+    {
+        // the faces are not reordered: the new tree refers to them through its face list
+        if(mRebuildBVH)
+            mBVH->buildLinear(this, 4);
+        else
+            mBVH->refit();
+        if(nbFaces() >= wideBVHMinFaces)
+            mBVH->buildWide();
+        mBBox = mBVH->boundingBox();
+    }
+    else
+        updateBoundingBox();
+    // the clusters keep their faces, but not their boxes
+    updateClusterBoxes();
+}
 
 
 //********************************************************************************
@@ -7,6 +7,8 @@
 
 class Shader;
 class BVH;
+class Frustum;
+struct CullingStats;
 
 class Mesh
 {
@@ -31,18 +33,82 @@ class Mesh
       Vector2f texcoord;
     };
 
+    /** Compact GPU vertex layout (20 bytes), decoded by the shaders */
+    struct QuantizedVertex
+    {
+      unsigned short position[4]; ///< normalized in the bounding box (the 4th is padding)
+      short normal[2];            ///< octahedral encoding
+      unsigned char color[4];     ///< RGBA8
+      unsigned short texcoord[2]; ///< half floats
+    };
+
 public:
-    Mesh() : mBVH(0) {}
+    typedef Eigen::Matrix<int,4,1,Eigen::DontAlign> Vector4i;
+    typedef Eigen::Matrix<float,4,1,Eigen::DontAlign> Weights4f;
+    typedef Eigen::Matrix<float,3,4> Matrix34f;
+    typedef std::vector<Matrix34f, Eigen::aligned_allocator<Matrix34f> > BoneList;
+
+    enum VertexFormat { VF_FLOAT, VF_QUANTIZED };
+
+    Mesh() : mLODRatio(1.f), mVertexFormat(VF_FLOAT), mIsInitialized(false), mBVH(0), mSkinDirty(false), mRebuildBVH(false), mBVHSpatialSplits(0.f), mOptimizeBVH(false) {}
     ~Mesh();
 
     /** load a triangular mesh from the file \a filename (.off or .obj) */
     bool load(const std::string& filename);
 
-    /** initialize OpenGL's Vertex Buffer Array (must be called once before calling draw()) */
+    /** initialize OpenGL's Vertex Buffer Array (must be called once before calling draw()),
+      * this is prepare() followed by upload() */
     void init();
 
-    /** Send the mesh to OpenGL for drawing using shader \a shd */
-    void draw(const Shader& shd);
+    /** CPU part of init(): bounding box, BVH and index optimization.
+      * Does not call OpenGL, so that several meshes can be prepared in parallel on worker threads. */
+    void prepare();
+
+    /** GL part of init(): creates and fills the buffers, must be called on the thread owning the context */
+    void upload();
+
+    /** Send the mesh to OpenGL for drawing using shader \a shd.
+      * If a \a frustum expressed in object space is given, clusters of faces lying outside are skipped.
+      * \a lod selects a simplified level built by buildLODs() (0 is the original mesh).
+      */
+    void draw(const Shader& shd, const Frustum* frustum = 0, CullingStats* stats = 0, int lod = 0);
+
+    /** Binds the vertex array of the mesh and sets its per-mesh uniforms (vertex decoding) in \a shd, which must be active.
+      * Consecutive drawBound() calls can then be issued without re-binding anything. */
+    void bind(const Shader& shd);
+
+    /** Same as draw() for a mesh already bound by bind().
+      * \return the number of draw calls issued */
+    int drawBound(const Frustum* frustum = 0, CullingStats* stats = 0, int lod = 0);
+
+    /** \returns the OpenGL id of the vertex array object, e.g. to sort draws by state */
+    unsigned int vertexArrayId() const { return mVertexArrayId; }
+
+    /** Builds up to \a nbLevels simplified versions of the mesh, each having about \a ratio times the faces of the previous one.
+      * Must be called before init() (or be followed by updateVBO()). Levels share the vertex buffer of the original mesh.
+      */
+    void buildLODs(int nbLevels = 3, float ratio = 0.4f);
+
+    /** Reorders the faces of each cluster and level of detail for the post-transform vertex cache (Forsyth),
+      * then the vertices in order of first use, for vertex fetch and BVH traversal locality.
+      * Cluster ranges and the BVH are kept valid. Called by init(), prints the ACMR before and after.
+      */
+    void optimizeIndices();
+
+    /// \returns the number of levels of detail, including the original mesh
+    int nbLODs() const { return 1 + int(mLODFaces.size()); }
+
+    /** \returns the level of detail to use for a mesh covering \a screenSize pixels (diameter of its bounding sphere):
+      * the number of triangles per pixel is kept about constant below \a fullDetailSize pixels.
+      */
+    int selectLOD(float screenSize, float fullDetailSize = 400.f) const;
+
+    /** Selects the layout of the vertex attributes in GPU memory: either full floats (48 bytes/vertex),
+      * or positions quantized to 16 bits in the bounding box, octahedral normals, RGBA8 colors and half float
+      * texture coordinates (20 bytes/vertex). Takes effect at the next updateVBO().
+      */
+    void setVertexFormat(VertexFormat format) { mVertexFormat = format; }
+    VertexFormat vertexFormat() const { return mVertexFormat; }
 
     /// Re-compute vertex normals (needs to be called after editing vertex positions)
     void updateNormals();
@@ -60,38 +126,141 @@ public:
     /// Re-compute the BVH for fast ray-mesh intersections (needs to be called after editing vertex positions)
     void updateBVH();
 
-    /// computes the first intersection between the ray and the mesh in hit (if any)
+    /** computes the first intersection between the ray and the mesh in hit (if any).
+      * If one is found, its intersection point, shading normal and shape are set, see finalizeHit() */
     bool intersect(const Ray& ray, Hit& hit) const;
 
+    /// \returns  the number of vertices
+    int nbVertices() const { return int(mVertices.size()); }
+
     /// \returns  the number of faces
     int nbFaces() const { return int(mFaces.size()); }
 
     /// \returns a const references to the \a vertexId -th vertex of the \a faceId -th face. vertexId must be between 0 and 2 !!
     const Vertex& vertexOfFace(int faceId, int vertexId) const { return mVertices[mFaces[faceId][vertexId]]; }
 
-    /** compute the intersection between a ray and a given triangular face */
+    /** compute the intersection between a ray and a given triangular face.
+      * Only the distance, face id and barycentric coordinates of \a hit are updated, see finalizeHit() */
     bool intersectFace(const Ray& ray, Hit& hit, int faceId) const;
 
+    /** Closest point of the mesh to \a p, within the distance \a maxDist, by a best-first traversal of the BVH.
+      * If one is found, hit.t() is its distance, and the face, barycentric coordinates, point and normal are set as for intersect(). */
+    bool closestPoint(const Point3f& p, float maxDist, Hit& hit) const;
+
+    /** Batched closestPoint(), in parallel: \a hits[i] is the closest point to \a points[i] (check hits[i].foundIntersection()) */
+    void closestPoints(const std::vector<Point3f>& points, float maxDist, std::vector<Hit>& hits) const;
+
+    /** \returns the squared distance between \a p and the face \a faceId, \a uvw are the barycentric coordinates of the closest point
+      * (weights of the vertices 1, 2 and 0, as for intersectFace()) */
+    float closestPointOnFace(const Point3f& p, int faceId, Vector3f& uvw) const;
+
+    /** Faces overlapping the capsule of axis [\a a, \a b] and radius \a radius, one contact per face, sorted by face.
+      * \returns true if \a contacts (cleared first) is not empty */
+    bool overlapCapsule(const Point3f& a, const Point3f& b, float radius, std::vector<Contact>& contacts) const;
+    bool overlapSphere(const Point3f& center, float radius, std::vector<Contact>& contacts) const
+    { return overlapCapsule(center, center, radius, contacts); }
+
+    /** Pairs of intersecting faces (face of this mesh, face of \a other), \a other being placed in the space of this mesh
+      * by \a otherToThis. Simultaneous traversal of both BVHs, which are required (see updateBVH()). If \a pairs is null,
+      * only tells whether the meshes intersect, stopping at the first contact. See BVH::intersects() */
+    bool intersects(const Mesh& other, const Eigen::Affine3f& otherToThis, std::vector<Eigen::Vector2i>* pairs = 0) const;
+
+    /** Pairs of intersecting faces of the mesh which do not share a vertex, see intersects() */
+    bool selfIntersects(std::vector<Eigen::Vector2i>* pairs = 0) const;
+
+    /** \returns the squared distance between the segment [\a a, \a b] and the face \a faceId,
+      * whose closest points are \a onFace and \a onSegment. A segment crossing the face is at distance 0. */
+    float closestPointsOnFace(const Point3f& a, const Point3f& b, int faceId, Point3f& onFace, Point3f& onSegment) const;
+
+    /** \returns the contact between the face \a faceId and the capsule [\a a, \a b], \a radius (depth <= 0 if they do not overlap) */
+    Contact contactWithFace(const Point3f& a, const Point3f& b, float radius, int faceId) const;
+
+    /** Computes the attributes of \a hit derived from its face and barycentric coordinates:
+      * intersection point, interpolated shading normal, and shape. Done once, after the traversal. */
+    void finalizeHit(Hit& hit) const;
+
+    // CPU skinning (keeps the CPU copy, and thus intersect(), in sync with a deformed pose):
+
+    /** Attach up to 4 bone influences per vertex. The current positions and normals become the rest pose. */
+    void setSkinning(const std::vector<Vector4i>& boneIds, const std::vector<Weights4f>& boneWeights);
+
+    /** Set the current pose (rest to posed space, one 3x4 affine matrix per bone).
+      * This is cheap: vertices are only deformed by the next call to updateSkinning().
+      */
+    void setBoneTransforms(const BoneList& bones);
+
+    /** Deforms positions and normals with the current pose and refits the BVH, if the pose changed.
+      * Call it only when CPU-side geometry is needed (picking, collisions). The VBO is not updated.
+      */
+    void updateSkinning();
+
+    bool isSkinned() const { return !mBoneIds.empty(); }
+
+    /** If \a rebuild is true, updateSkinning() rebuilds the BVH with the linear (Morton) builder instead of refitting it:
+      * a bit slower, but the tree does not degrade under large deformations. */
+    void setBVHRebuild(bool rebuild) { mRebuildBVH = rebuild; }
+
+    /** If \a maxDuplication > 0, the BVH used for ray queries is rebuilt with spatial splits (see BVH::buildSpatial()),
+      * and kept if its SAH cost is lower. Worth it for meshes with long and thin triangles. Call it before init(). */
+    void setBVHSpatialSplits(float maxDuplication) { mBVHSpatialSplits = maxDuplication; }
+
+    /** If \a optimize is true, the BVH is restructured after its build to lower its SAH cost (see BVH::optimize()).
+      * A slower build for a faster traversal: for static meshes which are often ray traced. Call it before init(). */
+    void setBVHOptimization(bool optimize) { mOptimizeBVH = optimize; }
+
 private:
+    /** sets the attribute pointers of the vertex array, at the standard locations of Shader */
+    void setupVertexArray();
+
 
     /** Loads a triangular mesh in the OFF format */
     bool loadOFF(const std::string& filename);
     bool loadOBJ(const std::string& filename);
 
+    /** Encodes the vertices in the compact layout, and reports the maximal position and normal errors */
+    void quantizeVertices(std::vector<QuantizedVertex>& vertices);
+
+    /** Recomputes the box of each cluster from its faces, after its vertices moved (the ranges do not change) */
+    void updateClusterBoxes();
+
     /** The list of vertices */
     std::vector<Vertex> mVertices;
 
     /** The list of face indices */
     std::vector<Vector3i> mFaces;
 
+    /** The face indices of the simplified levels 1, 2, ... */
+    std::vector< std::vector<Vector3i> > mLODFaces;
+    float mLODRatio;
+
+    VertexFormat mVertexFormat;
+    Eigen::AlignedBox3f mQuantizationBox; ///< the box used to quantize the positions of the current VBO
+
     unsigned int mVertexArrayId;
     unsigned int mVertexBufferId; ///< the id of the BufferObject storing the vertex attributes
     unsigned int mIndexBufferId;  ///< the id of the BufferObject storing the faces indices
+    std::vector<unsigned int> mLODIndexBufferIds; ///< the faces indices of each simplified level
     bool mIsInitialized;
 
     Eigen::AlignedBox3f mBBox;
 
     BVH *mBVH;
+
+    /** Spatially coherent groups of faces, for culling parts of large meshes */
+    std::vector<Eigen::AlignedBox3f> mClusterBoxes;
+    std::vector<Eigen::Vector2i> mClusterRanges; ///< (first face, number of faces)
+    std::vector<unsigned char> mClusterVisible;
+
+    // skinning data
+    std::vector<Vector3f> mRestPositions;
+    std::vector<Vector3f> mRestNormals;
+    std::vector<Vector4i> mBoneIds;
+    std::vector<Weights4f> mBoneWeights;
+    BoneList mBones;
+    bool mSkinDirty;
+    bool mRebuildBVH;
+    float mBVHSpatialSplits;
+    bool mOptimizeBVH;
 };
 
 
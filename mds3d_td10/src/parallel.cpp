@@ -0,0 +1,39 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+int nbThreads()
+{
+    static const int n = std::max<int>(1, std::thread::hardware_concurrency());
+    return n;
+}
+
+void parallelFor(int n, const std::function<void(int,int)>& func, int minChunk)
+{
+    if(n<=0)
+        return;
+    int nbChunks = std::min(nbThreads(), (n+minChunk-1)/std::max(1,minChunk));
+    if(nbChunks<=1)
+    {
+        func(0, n);
+        return;
+    }
+
+    int chunkSize = (n+nbChunks-1)/nbChunks;
+    std::vector<std::thread> workers;
+    workers.reserve(nbChunks-1);
+    for(int c=1; c<nbChunks; ++c)
+    {
+        int start = c*chunkSize;
+        int end = std::min(n, start+chunkSize);
+        if(start<end)
+            workers.push_back(std::thread(func, start, end));
+    }
+    // the calling thread takes the first chunk
+    func(0, std::min(n, chunkSize));
+
+    for(std::size_t i=0; i<workers.size(); ++i)
+        workers[i].join();
+}
@@ -0,0 +1,15 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+/** \returns the number of worker threads used by parallelFor() (at least 1) */
+int nbThreads();
+
+/** Splits the range [0,n) into contiguous chunks of at least \a minChunk elements
+  * and calls \a func(start,end) for each of them on a pool of std::threads.
+  * Small ranges are processed on the calling thread.
+  */
+void parallelFor(int n, const std::function<void(int,int)>& func, int minChunk = 1024);
+
+#endif // PARALLEL_H
@@ -47,23 +47,40 @@ public:
     void setIntersectionPoint(const Vector3f& p)  { m_intersectionPoint = p; }
     const Vector3f& intersectionPoint() const { return m_intersectionPoint; }
 
+    /// interpolated vertex normal at the intersection point
+    void setNormal(const Normal3f& n)  { m_normal = n; }
+    const Normal3f& normal() const { return m_normal; }
+
 private:
     Vector3f m_uvw;
     Vector3f m_intersectionPoint;
+    Normal3f m_normal;
     const Mesh* m_shape;
     int m_faceId;
     float m_t;
 };
 
+/** Overlap between a face and a sphere or capsule, see Mesh::overlapCapsule() */
+struct Contact
+{
+    Point3f point;      ///< closest point of the face to the axis of the capsule
+    Normal3f normal;    ///< unit direction pushing the capsule out of the face
+    float depth;        ///< radius minus the distance between the face and the axis
+    int faceId;
+};
+
 /** Compute the intersection between a ray and an aligned box
   * \returns true if an intersection is found
   * The ranges are returned in tMin,tMax
   */
 static inline bool intersect(const Ray& ray, const Eigen::AlignedBox3f& box, float& tMin, float& tMax, Normal3f& normal)
 {
+    // tiny direction components instead of zeros: 0/0 would give NaN for rays lying in a slab plane
+    Eigen::Array3f dir = ray.direction.array();
+    dir = (dir.abs() > 1e-20f).select(dir, Eigen::Array3f::Constant(1e-20f));
     Eigen::Array3f t1, t2;
-    t1 = (box.min()-ray.origin).cwiseQuotient(ray.direction);
-    t2 = (box.max()-ray.origin).cwiseQuotient(ray.direction);
+    t1 = (box.min()-ray.origin).array() / dir;
+    t2 = (box.max()-ray.origin).array() / dir;
     Eigen::Array3f::Index maxIdx, minIdx;
     tMin = t1.min(t2).maxCoeff(&maxIdx);
     tMax = t1.max(t2).minCoeff(&minIdx);
@@ -0,0 +1,83 @@
+#include "render_queue.h"
+#include "shader.h"
+#include "mesh.h"
+#include "frustum.h"
+
+#include <algorithm>
+
+using namespace Eigen;
+
+void RenderQueue::submit(Shader& shader, Mesh& mesh, const Material& material, const Matrix4f& transform, int lod)
+{
+    Item item;
+    item.key = (static_cast<unsigned long long>(shader.id() & 0xffff) << 48)
+             | (static_cast<unsigned long long>(mesh.vertexArrayId() & 0xffff) << 32)
+             | (static_cast<unsigned long long>(material.texture & 0xffff) << 16)
+             | static_cast<unsigned long long>(lod & 0xffff);
+    item.shader = &shader;
+    item.mesh = &mesh;
+    item.material = material;
+    item.transform = transform;
+    item.lod = lod;
+    mItems.push_back(item);
+}
+
+void RenderQueue::execute(const Matrix4f& view, const Matrix4f* viewProj, CullingStats* cullingStats)
+{
+    mStats.reset();
+    mStats.items = int(mItems.size());
+
+    // sort pointers rather than the items themselves (80 bytes each); stable to keep the submission order among equal states
+    mSorted.resize(mItems.size());
+    for(std::size_t i=0; i<mItems.size(); ++i)
+        mSorted[i] = &mItems[i];
+    std::stable_sort(mSorted.begin(), mSorted.end(), [](const Item* a, const Item* b) { return *a < *b; });
+
+    Shader* shader = 0;
+    Mesh* mesh = 0;
+    unsigned int texture = 0;
+    int objLoc = -1, normalLoc = -1, colorLoc = -1;
+    for(std::size_t i=0; i<mSorted.size(); ++i)
+    {
+        const Item& item = *mSorted[i];
+        if(item.shader!=shader)
+        {
+            shader = item.shader;
+            shader->activate();
+            objLoc = shader->getUniformLocation("obj_mat");
+            normalLoc = shader->getUniformLocation("normal_mat");
+            colorLoc = shader->getUniformLocation("color");
+            mesh = 0; // the per-mesh uniforms have to be set in the new program
+            ++mStats.programChanges;
+        }
+        if(item.mesh!=mesh)
+        {
+            mesh = item.mesh;
+            mesh->bind(*shader);
+            ++mStats.meshChanges;
+        }
+        if(item.material.texture!=0 && item.material.texture!=texture)
+        {
+            texture = item.material.texture;
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            ++mStats.textureChanges;
+        }
+
+        glUniformMatrix4fv(objLoc, 1, GL_FALSE, item.transform.data());
+        Matrix3f normalMatrix = (view * item.transform).topLeftCorner<3,3>().inverse().transpose();
+        glUniformMatrix3fv(normalLoc, 1, GL_FALSE, normalMatrix.data());
+        glUniform3fv(colorLoc, 1, item.material.color.data());
+
+        if(viewProj)
+        {
+            // frustum planes expressed in the object space
+            Frustum frustum(*viewProj * item.transform);
+            mStats.drawCalls += mesh->drawBound(&frustum, cullingStats, item.lod);
+        }
+        else
+        {
+            mStats.drawCalls += mesh->drawBound(0, cullingStats, item.lod);
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <Eigen/Core>
+#include <vector>
+
+class Shader;
+class Mesh;
+struct CullingStats;
+
+/** Appearance of a drawn object */
+struct Material
+{
+    Material(const Eigen::Vector3f& color = Eigen::Vector3f::Ones(), unsigned int texture = 0)
+      : color(color), texture(texture)
+    {}
+
+    Eigen::Vector3f color;  ///< "color" uniform
+    unsigned int texture;   ///< bound to the unit 0 if not 0
+};
+
+/** Per-frame counters of the RenderQueue */
+struct RenderStats
+{
+    RenderStats() { reset(); }
+    void reset() { items = programChanges = meshChanges = textureChanges = drawCalls = 0; }
+
+    int items;
+    int programChanges;  ///< glUseProgram
+    int meshChanges;     ///< vertex array binds
+    int textureChanges;  ///< glBindTexture
+    int drawCalls;       ///< glDrawElements
+};
+
+/** Collects the draws of a frame, and executes them sorted by state (program, then vertex array, then texture)
+  * to minimize the state changes. The objects are opaque, so their order does not matter otherwise.
+  *
+  * The per-frame uniforms (view_mat, proj_mat, lightDir, ...) must be set in each shader beforehand;
+  * the queue sets the per-object ones: obj_mat, normal_mat and color.
+  */
+class RenderQueue
+{
+public:
+    void clear() { mItems.clear(); }
+
+    /** Adds a draw of \a lod of \a mesh with \a shader, transformed by \a transform */
+    void submit(Shader& shader, Mesh& mesh, const Material& material, const Eigen::Matrix4f& transform, int lod = 0);
+
+    /** Draws the submitted items.
+      * \param view the view matrix, for the normal matrices
+      * \param viewProj if not null, the clusters of faces outside its frustum are skipped
+      */
+    void execute(const Eigen::Matrix4f& view, const Eigen::Matrix4f* viewProj, CullingStats* cullingStats = 0);
+
+    /** \returns the counters of the last execute() */
+    const RenderStats& stats() const { return mStats; }
+
+private:
+    struct Item
+    {
+        unsigned long long key; ///< state, most expensive changes in the high bits
+        Shader* shader;
+        Mesh* mesh;
+        Material material;
+        Eigen::Matrix4f transform;
+        int lod;
+
+        bool operator<(const Item& other) const { return key < other.key; }
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+    std::vector<Item, Eigen::aligned_allocator<Item> > mItems;
+    std::vector<const Item*> mSorted;
+    RenderStats mStats;
+};
+
+#endif // RENDER_QUEUE_H
@@ -0,0 +1,228 @@
+#include "sdf.h"
+#include "mesh.h"
+#include "parallel.h"
+
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <map>
+
+using namespace Eigen;
+
+namespace {
+
+/** lexicographic order, to weld vertices sharing the same position */
+struct PositionCompare
+{
+    bool operator()(const Vector3f& a, const Vector3f& b) const
+    {
+        if(a.x()!=b.x()) return a.x()<b.x();
+        if(a.y()!=b.y()) return a.y()<b.y();
+        return a.z()<b.z();
+    }
+};
+
+/** Angle-weighted pseudo-normals (Baerentzen and Aanaes, 2005) of a mesh welded by position: the face normal inside a face,
+  * the sum of the normals of the adjacent faces on an edge, and their sum weighted by the incident angles on a vertex.
+  * The sign of (p-q).n is then right for any closest point q, including on the edges and corners of meshes whose
+  * vertices are split per face normal, where the interpolated shading normal is arbitrary. */
+class PseudoNormals
+{
+public:
+    explicit PseudoNormals(const Mesh& mesh)
+    {
+        int nbFaces = mesh.nbFaces();
+        std::map<Vector3f,int,PositionCompare> ids;
+        mCorners.resize(3*nbFaces);
+        for(int f=0; f<nbFaces; ++f)
+            for(int k=0; k<3; ++k)
+                mCorners[3*f+k] = ids.insert(std::make_pair(mesh.vertexOfFace(f, k).position, int(ids.size()))).first->second;
+
+        mFaceNormals.resize(nbFaces);
+        mVertexNormals.assign(ids.size(), Vector3f::Zero());
+        std::map<std::pair<int,int>,Vector3f> edges;
+        for(int f=0; f<nbFaces; ++f)
+        {
+            Vector3f p[3] = { mesh.vertexOfFace(f, 0).position, mesh.vertexOfFace(f, 1).position, mesh.vertexOfFace(f, 2).position };
+            Vector3f n = (p[1]-p[0]).cross(p[2]-p[0]);
+            float area = n.norm();
+            n = area>0 ? Vector3f(n/area) : Vector3f::Zero(); // degenerated faces do not contribute
+            mFaceNormals[f] = n;
+            for(int k=0; k<3; ++k)
+            {
+                Vector3f e1 = p[(k+1)%3]-p[k], e2 = p[(k+2)%3]-p[k];
+                mVertexNormals[mCorners[3*f+k]] += std::atan2(e1.cross(e2).norm(), e1.dot(e2)) * n;
+                edges.insert(std::make_pair(edge(f, k), Vector3f::Zero())).first->second += n; // Eigen does not zero new vectors
+            }
+        }
+        mEdgeNormals.resize(3*nbFaces);
+        for(int f=0; f<nbFaces; ++f)
+            for(int k=0; k<3; ++k)
+                mEdgeNormals[3*f+k] = edges[edge(f, k)];
+    }
+
+    /** \returns the (unnormalized) pseudo-normal at the closest point \a hit, on a face, an edge or a vertex */
+    Vector3f normal(const Hit& hit) const
+    {
+        // weights of the vertices 0, 1 and 2 (see Mesh::finalizeHit()), exactly 0 out of the face region
+        // of Mesh::closestPointOnFace() but for the edge 12 whose third weight is computed as 1-u-v
+        const Vector3f& uvw = hit.baryCoords();
+        const float w[3] = { uvw[2], uvw[0], uvw[1] };
+        const float eps = 1e-5f;
+        int f = hit.faceId(), nbZeros = 0, zero = 0, nonZero = 0;
+        for(int k=0; k<3; ++k)
+        {
+            if(w[k]<eps)
+            {
+                ++nbZeros;
+                zero = k;
+            }
+            else
+                nonZero = k;
+        }
+        if(nbZeros>=2)
+            return mVertexNormals[mCorners[3*f+nonZero]];
+        if(nbZeros==1)
+            return mEdgeNormals[3*f+(zero+1)%3];  // edge opposite to the vertex of weight 0
+        return mFaceNormals[f];
+    }
+
+private:
+    /** welded end-points of the edge from the vertex \a k to the next one of the face \a f */
+    std::pair<int,int> edge(int f, int k) const
+    {
+        int a = mCorners[3*f+k], b = mCorners[3*f+(k+1)%3];
+        return a<b ? std::make_pair(a, b) : std::make_pair(b, a);
+    }
+
+    std::vector<int> mCorners;              ///< welded vertex of each corner of each face
+    std::vector<Vector3f> mFaceNormals;
+    std::vector<Vector3f> mEdgeNormals;     ///< per corner, of the edge to the next corner
+    std::vector<Vector3f> mVertexNormals;   ///< per welded vertex
+};
+
+/** Distance from \a p to \a mesh, clamped to \a maxDist, signed by the pseudo-normal at the closest point.
+  * Unlike ray parity or winding numbers, this also holds for open surfaces such as terrains, and reuses the
+  * closest point query of the distance. */
+float signedDistance(const Mesh& mesh, const PseudoNormals& normals, const Point3f& p, float maxDist)
+{
+    Hit hit;
+    bool near = mesh.closestPoint(p, maxDist, hit);
+    // farther: only the sign is needed
+    if(!near && !mesh.closestPoint(p, std::numeric_limits<float>::max(), hit))
+        return maxDist;
+    float d = near ? hit.t() : maxDist;
+    return (p-hit.intersectionPoint()).dot(normals.normal(hit))<0 ? -d : d;
+}
+
+} // namespace
+
+void SignedDistanceField::bake(const Mesh& mesh, float voxelSize, float bandWidth)
+{
+    auto t0 = std::chrono::high_resolution_clock::now();
+    mVoxelSize = voxelSize;
+    mBandWidth = bandWidth;
+    mBrickIds.clear();
+    mSamples.clear();
+    if(mesh.nbFaces()==0)
+        return;
+
+    // 1 - grid of bricks covering the box of the mesh and the band
+    AlignedBox3f box = mesh.boundingBox();
+    box.min().array() -= bandWidth;
+    box.max().array() += bandWidth;
+    float brickWidth = brickSize*voxelSize;
+    mOrigin = box.min();
+    mDims = (box.sizes()/brickWidth).array().ceil().cast<int>().max(1);
+    int nbBricks = mDims.prod();
+
+    // 2 - bricks crossing the band, the others are entirely inside or outside
+    PseudoNormals normals(mesh);
+    float halfDiagonal = 0.5f*std::sqrt(3.f)*brickWidth;
+    std::vector<int> ids(nbBricks);
+    parallelFor(nbBricks, [&](int start, int end) {
+        for(int b=start; b<end; ++b)
+        {
+            Vector3i brick(b%mDims.x(), (b/mDims.x())%mDims.y(), b/(mDims.x()*mDims.y()));
+            Point3f center = mOrigin + (brick.cast<float>().array()+0.5f).matrix()*brickWidth;
+            float d = signedDistance(mesh, normals, center, bandWidth+halfDiagonal);
+            if(std::abs(d)<bandWidth+halfDiagonal)
+                ids[b] = 0;
+            else if(d<0)
+                ids[b] = insideBrick;
+            else
+                ids[b] = outsideBrick;
+        }
+    }, 16);
+    int nbBaked = 0;
+    for(int b=0; b<nbBricks; ++b)
+        if(ids[b]==0)
+            ids[b] = nbBaked++;
+    mBrickIds.swap(ids);
+
+    // 3 - samples of the baked bricks
+    mSamples.resize(std::size_t(nbBaked)*samplesPerBrick);
+    float scale = 32767.f/bandWidth;
+    parallelFor(nbBricks, [&](int start, int end) {
+        for(int b=start; b<end; ++b)
+        {
+            if(mBrickIds[b]<0)
+                continue;
+            Vector3i brick(b%mDims.x(), (b/mDims.x())%mDims.y(), b/(mDims.x()*mDims.y()));
+            Point3f corner = mOrigin + brick.cast<float>()*brickWidth;
+            int16_t* samples = &mSamples[std::size_t(mBrickIds[b])*samplesPerBrick];
+            for(int i=0; i<samplesPerBrick; ++i)
+            {
+                Point3f p = corner + Vector3f(float(i%brickSamples), float((i/brickSamples)%brickSamples),
+                                              float(i/(brickSamples*brickSamples)))*voxelSize;
+                samples[i] = int16_t(std::lround(signedDistance(mesh, normals, p, bandWidth)*scale));
+            }
+        }
+    }, 1);
+
+    double ms = std::chrono::duration<double,std::milli>(std::chrono::high_resolution_clock::now()-t0).count();
+    std::cout << "  SDF: " << nbBaked << "/" << nbBricks << " bricks, "
+              << mSamples.size()*sizeof(int16_t)/1024 << " KB, baked in " << ms << " ms" << std::endl;
+}
+
+float SignedDistanceField::distance(const Point3f& p, Vector3f* gradient) const
+{
+    if(gradient)
+        gradient->setZero();
+    if(mBrickIds.empty())
+        return mBandWidth;
+
+    // cell of p, and its position in the cell
+    Array3f x = (p-mOrigin).array()/mVoxelSize;
+    Array3f cell = x.floor();
+    if((cell<0.f).any() || (cell>=(mDims.array()*int(brickSize)).cast<float>()).any())
+        return mBandWidth;
+    Vector3i c = cell.cast<int>();
+    Array3f f = x-cell;
+
+    Vector3i brick = c/int(brickSize);
+    int id = mBrickIds[(brick.z()*mDims.y() + brick.y())*mDims.x() + brick.x()];
+    if(id<0)
+        return id==insideBrick ? -mBandWidth : mBandWidth;
+    Vector3i l = c - brick*int(brickSize);
+    const int16_t* s = &mSamples[std::size_t(id)*samplesPerBrick + (l.z()*brickSamples + l.y())*brickSamples + l.x()];
+
+    // corners (x fastest), interpolated along x, then y, then z
+    const int dy = brickSamples, dz = brickSamples*brickSamples;
+    float c000 = s[0],       c100 = s[1],         c010 = s[dy],      c110 = s[dy+1];
+    float c001 = s[dz],      c101 = s[dz+1],      c011 = s[dz+dy],   c111 = s[dz+dy+1];
+    float c00 = c000 + f.x()*(c100-c000), c10 = c010 + f.x()*(c110-c010);
+    float c01 = c001 + f.x()*(c101-c001), c11 = c011 + f.x()*(c111-c011);
+    float c0 = c00 + f.y()*(c10-c00), c1 = c01 + f.y()*(c11-c01);
+    float unit = mBandWidth/32767.f;
+    if(gradient)
+    {
+        float gx0 = (c100-c000) + f.y()*((c110-c010)-(c100-c000));
+        float gx1 = (c101-c001) + f.y()*((c111-c011)-(c101-c001));
+        *gradient = Vector3f(gx0 + f.z()*(gx1-gx0),
+                             (c10-c00) + f.z()*((c11-c01)-(c10-c00)),
+                             c1-c0) * (unit/mVoxelSize);
+    }
+    return (c0 + f.z()*(c1-c0))*unit;
+}
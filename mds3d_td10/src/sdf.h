@@ -0,0 +1,57 @@
+#ifndef SDF_H
+#define SDF_H
+
+#include "ray.h"
+#include <vector>
+#include <cstdint>
+
+class Mesh;
+
+/** Signed distance field of a mesh (negative inside), sampled on a regular grid stored as sparse bricks.
+  * Only the bricks of 8^3 cells closer to the surface than the band width store their 9^3 samples (quantized to 16 bits,
+  * the samples on the faces of a brick are duplicated so that it can be interpolated on its own); the others only
+  * record whether they are inside or outside. A query is then a constant time trilinear interpolation, without
+  * any BVH traversal: meant for repeated proximity queries against static geometry.
+  * Example:
+  * \code
+  * SignedDistanceField sdf;
+  * sdf.bake(scene, 0.05f, 0.5f);
+  * Vector3f n;
+  * float d = sdf.distance(p, &n); // push p out along n by -d if negative
+  * \endcode
+  */
+class SignedDistanceField
+{
+public:
+    SignedDistanceField() : mVoxelSize(0), mBandWidth(0) {}
+
+    /** Samples the distance to \a mesh every \a voxelSize within \a bandWidth of its surface, using its BVH (see Mesh::closestPoint()).
+      * The sign is given by the angle-weighted pseudo-normal at the closest point, on the mesh welded by position:
+      * \a mesh should be consistently oriented, but can be open (e.g. a terrain, whose underside is then inside).
+      * Bricks are baked in parallel. */
+    void bake(const Mesh& mesh, float voxelSize, float bandWidth);
+
+    /** \returns the trilinearly interpolated signed distance at \a p, clamped to [-bandWidth(), bandWidth()],
+      * and its gradient in \a gradient if not null (zero outside the band). Points outside the grid are outside. */
+    float distance(const Point3f& p, Vector3f* gradient = 0) const;
+
+    float bandWidth() const { return mBandWidth; }
+    float voxelSize() const { return mVoxelSize; }
+    int nbBricks() const { return int(mSamples.size()/samplesPerBrick); }
+    bool isEmpty() const { return mBrickIds.empty(); }
+
+private:
+    static const int brickSize = 8;                 ///< cells per brick along each axis
+    static const int brickSamples = brickSize+1;
+    static const int samplesPerBrick = brickSamples*brickSamples*brickSamples;
+    static const int outsideBrick = -1;             ///< brick ids of the bricks without samples
+    static const int insideBrick = -2;
+
+    Point3f mOrigin;                    ///< corner of the grid
+    Eigen::Vector3i mDims;              ///< number of bricks along each axis
+    float mVoxelSize, mBandWidth;
+    std::vector<int> mBrickIds;         ///< first sample of each brick (divided by samplesPerBrick), or outsideBrick/insideBrick
+    std::vector<int16_t> mSamples;      ///< x fastest, distance*32767/mBandWidth
+};
+
+#endif // SDF_H
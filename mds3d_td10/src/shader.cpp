@@ -1,8 +1,16 @@
 #include "shader.h"
+#include "hash.h"
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <assert.h>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <glbinding/gl/functions.h>
+#include <glbinding/gl/enum.h>
+
+std::string Shader::sCacheDirectory;
 
 std::string loadSourceFromFile(const std::string& filename)
 {
@@ -26,67 +34,266 @@ std::string loadSourceFromFile(const std::string& filename)
 }
 
 //--------------------------------------------------------------------------------
-bool Shader::loadFromFiles(const std::string& fileV, const std::string& fileF)
+Shader::~Shader()
 {
-    std::string vsrc = loadSourceFromFile(fileV);
-    std::string fsrc = loadSourceFromFile(fileF);
-    return loadSources(vsrc,fsrc);
+    if(mPendingProgramID)
+    {
+        for(std::size_t i=0; i<mPendingShaderIDs.size(); ++i)
+            glDeleteShader(mPendingShaderIDs[i]);
+        glDeleteProgram(mPendingProgramID);
+    }
+    if(mProgramID)
+        glDeleteProgram(mProgramID);
 }
 //--------------------------------------------------------------------------------
-bool Shader::loadSources(const std::string& vsrc, const std::string& fsrc)
+bool Shader::loadFromFiles(const std::string& fileV, const std::string& fileF, const std::string& fileG,
+                           const std::vector<std::string>& defines)
 {
-    bool allIsOk = true;
+    mFileV = fileV;
+    mFileF = fileF;
+    mFileG = fileG;
+    mDefines = defines;
 
-    mProgramID = glCreateProgram();
+    std::string vsrc = injectDefines(loadSourceFromFile(fileV), defines);
+    std::string fsrc = injectDefines(loadSourceFromFile(fileF), defines);
+    std::string gsrc = fileG.empty() ? "" : injectDefines(loadSourceFromFile(fileG), defines);
+    return loadSources(vsrc,fsrc,gsrc);
+}
+//--------------------------------------------------------------------------------
+std::string Shader::injectDefines(const std::string& src, const std::vector<std::string>& defines)
+{
+    if(defines.empty())
+        return src;
+    std::string block;
+    for(std::size_t i=0; i<defines.size(); ++i)
+        block += "#define " + defines[i] + "\n";
+    // the #version directive must remain the first statement
+    std::size_t pos = src.find("#version");
+    if(pos==std::string::npos)
+        return block + src;
+    pos = src.find('\n', pos);
+    if(pos==std::string::npos)
+        return src + "\n" + block;
+    return src.substr(0, pos+1) + block + src.substr(pos+1);
+}
+//--------------------------------------------------------------------------------
+GLuint Shader::compileAndAttach(GLuint programID, GLenum type, const std::string& src)
+{
+    GLuint shaderID = glCreateShader(type);
 
-    // vertex shader
-    {
-        GLuint shaderID = glCreateShader(GL_VERTEX_SHADER);
+    const GLchar * arbSource = src.c_str();
+
+    glShaderSource(shaderID, 1, (const GLchar **)&arbSource, 0);
+    glCompileShader(shaderID);
+    glAttachShader(programID, shaderID);
 
-        const GLchar * arbSource = vsrc.c_str();
+    return shaderID;
+}
+//--------------------------------------------------------------------------------
+bool Shader::loadSources(const std::string& vsrc, const std::string& fsrc, const std::string& gsrc)
+{
+    startLoad(vsrc, fsrc, gsrc);
+    return finishLoad();
+}
+//--------------------------------------------------------------------------------
+void Shader::startLoad(const std::string& vsrc, const std::string& fsrc, const std::string& gsrc)
+{
+    // cancel a previous pending load
+    if(mPendingProgramID)
+    {
+        for(std::size_t i=0; i<mPendingShaderIDs.size(); ++i)
+            glDeleteShader(mPendingShaderIDs[i]);
+        glDeleteProgram(mPendingProgramID);
+    }
+    mPendingShaderIDs.clear();
+    mPendingCacheFile.clear();
+    mPendingFromCache = false;
 
-        glShaderSource(shaderID, 1, (const GLchar **)&arbSource, 0);
-        glCompileShader(shaderID);
+    mPendingProgramID = glCreateProgram();
 
-        int compiled;
-        glGetShaderiv(shaderID,GL_COMPILE_STATUS,&compiled);
-        allIsOk = allIsOk && compiled;
-        printShaderInfoLog(shaderID);
+    if(!sCacheDirectory.empty() && binaryCacheSupported())
+    {
+        // hash of the sources and of the driver
+        unsigned long long hash = hashString(vsrc + '\0' + gsrc + '\0' + fsrc + '\0' + "attribs:1" + '\0'
+                                             + (const char*)glGetString(GL_VENDOR) + (const char*)glGetString(GL_RENDERER)
+                                             + (const char*)glGetString(GL_VERSION));
+        std::ostringstream name;
+        name << sCacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+        mPendingCacheFile = name.str();
 
-        if(compiled)
-            glAttachShader(mProgramID, shaderID);
+        if(loadBinary(mPendingProgramID, mPendingCacheFile))
+        {
+            mPendingFromCache = true;
+            return;
+        }
+        gl::glProgramParameteri(mPendingProgramID, gl::GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     }
 
-    // fragment shader
-    {
-        GLuint shaderID = glCreateShader(GL_FRAGMENT_SHADER);
+    mPendingShaderIDs.push_back(compileAndAttach(mPendingProgramID, GL_VERTEX_SHADER, vsrc));
+    if(!gsrc.empty())
+        mPendingShaderIDs.push_back(compileAndAttach(mPendingProgramID, GL_GEOMETRY_SHADER, gsrc));
+    mPendingShaderIDs.push_back(compileAndAttach(mPendingProgramID, GL_FRAGMENT_SHADER, fsrc));
 
-        const GLchar * arbSource = fsrc.c_str();
+    glBindAttribLocation(mPendingProgramID, ATTRIB_POSITION, "vtx_position");
+    glBindAttribLocation(mPendingProgramID, ATTRIB_NORMAL, "vtx_normal");
+    glBindAttribLocation(mPendingProgramID, ATTRIB_COLOR, "vtx_color");
+    glBindAttribLocation(mPendingProgramID, ATTRIB_TEXCOORD, "vtx_texcoord");
+    glLinkProgram(mPendingProgramID);
+}
+//--------------------------------------------------------------------------------
+bool Shader::isLoadComplete() const
+{
+    if(mPendingFromCache || !parallelCompileSupported())
+        return true;
+    int done = 0;
+    glGetProgramiv(mPendingProgramID, gl::GL_COMPLETION_STATUS_KHR, &done);
+    return done != 0;
+}
+//--------------------------------------------------------------------------------
+bool Shader::finishLoad()
+{
+    if(!mPendingProgramID)
+        return false;
 
-        glShaderSource(shaderID, 1, (const GLchar **)&arbSource, 0);
-        glCompileShader(shaderID);
+    bool allIsOk = true;
+    for(std::size_t i=0; i<mPendingShaderIDs.size(); ++i)
+    {
         int compiled;
-        glGetShaderiv(shaderID,GL_COMPILE_STATUS,&compiled);
-
+        glGetShaderiv(mPendingShaderIDs[i],GL_COMPILE_STATUS,&compiled);
         allIsOk = allIsOk && compiled;
-        printShaderInfoLog(shaderID);
-
-        if(compiled)
-            glAttachShader(mProgramID, shaderID);
+        printShaderInfoLog(mPendingShaderIDs[i]);
     }
 
-    glLinkProgram(mProgramID);
-
     int isLinked;
-    glGetProgramiv(mProgramID, GL_LINK_STATUS, &isLinked);
+    glGetProgramiv(mPendingProgramID, GL_LINK_STATUS, &isLinked);
     allIsOk = allIsOk && isLinked;
-    mIsValid = (isLinked == (int)GL_TRUE);
+    if(allIsOk && !mPendingFromCache)
+        printProgramInfoLog(mPendingProgramID);
+
+    // the shader objects are not needed anymore once the program is linked
+    for(std::size_t i=0; i<mPendingShaderIDs.size(); ++i)
+    {
+        glDetachShader(mPendingProgramID, mPendingShaderIDs[i]);
+        glDeleteShader(mPendingShaderIDs[i]);
+    }
+    mPendingShaderIDs.clear();
+
     if(allIsOk)
-        printProgramInfoLog(mProgramID);
-    
+    {
+        if(!mPendingFromCache && !mPendingCacheFile.empty())
+            saveBinary(mPendingProgramID, mPendingCacheFile);
+        // swap in the new program
+        if(mProgramID)
+            glDeleteProgram(mProgramID);
+        mProgramID = mPendingProgramID;
+        mUniformLocations.clear();
+        mIsValid = true;
+    }
+    else
+    {
+        // keep the previous program, if any
+        glDeleteProgram(mPendingProgramID);
+    }
+    mPendingProgramID = 0;
+
     return allIsOk;
 }
 //--------------------------------------------------------------------------------
+void Shader::reload()
+{
+    std::string vsrc = injectDefines(loadSourceFromFile(mFileV), mDefines);
+    std::string fsrc = injectDefines(loadSourceFromFile(mFileF), mDefines);
+    std::string gsrc = mFileG.empty() ? "" : injectDefines(loadSourceFromFile(mFileG), mDefines);
+    startLoad(vsrc, fsrc, gsrc);
+}
+//--------------------------------------------------------------------------------
+bool Shader::pollReload()
+{
+    if(!mPendingProgramID || !isLoadComplete())
+        return false;
+    return finishLoad();
+}
+//--------------------------------------------------------------------------------
+bool Shader::usesFile(const std::string& filename) const
+{
+    return filename==mFileV || filename==mFileF || (!mFileG.empty() && filename==mFileG);
+}
+//--------------------------------------------------------------------------------
+bool Shader::binaryCacheSupported()
+{
+    static int nbFormats = -1;
+    if(nbFormats<0)
+    {
+        nbFormats = 0;
+        glGetIntegerv(gl::GL_NUM_PROGRAM_BINARY_FORMATS, &nbFormats);
+        glGetError(); // not an error if unsupported
+    }
+    return nbFormats>0;
+}
+//--------------------------------------------------------------------------------
+bool Shader::parallelCompileSupported()
+{
+    static int supported = -1;
+    if(supported<0)
+    {
+        supported = 0;
+        int nbExtensions = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &nbExtensions);
+        for(int i=0; i<nbExtensions && !supported; ++i)
+        {
+            std::string name = (const char*)glGetStringi(GL_EXTENSIONS, i);
+            if(name=="GL_KHR_parallel_shader_compile")
+            {
+                supported = 1;
+                gl::glMaxShaderCompilerThreadsKHR(0xFFFFFFFF); // let the driver choose
+            }
+        }
+    }
+    return supported!=0;
+}
+//--------------------------------------------------------------------------------
+bool Shader::loadBinary(GLuint programID, const std::string& filename)
+{
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    if(!in)
+        return false;
+    unsigned int format = 0;
+    if(!in.read((char*)&format, sizeof(format)))
+        return false;
+    // the iterators read the streambuf directly, the state of the stream (e.g. eof) is not updated
+    std::string binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if(binary.empty())
+        return false;
+
+    gl::glProgramBinary(programID, GLenum(format), binary.data(), GLsizei(binary.size()));
+    int isLinked;
+    glGetProgramiv(programID, GL_LINK_STATUS, &isLinked);
+    // on failure (e.g. the driver has been updated) the program is reset to an unlinked state,
+    // and is rebuilt from the sources
+    return isLinked == (int)GL_TRUE;
+}
+//--------------------------------------------------------------------------------
+void Shader::saveBinary(GLuint programID, const std::string& filename)
+{
+    int length = 0;
+    glGetProgramiv(programID, gl::GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length<=0)
+        return;
+    std::vector<char> binary(length);
+    GLenum format;
+    gl::glGetProgramBinary(programID, length, &length, &format, binary.data());
+
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary);
+    if(!out)
+    {
+        std::cerr << "Shader: cannot write the cache file " << filename << std::endl;
+        return;
+    }
+    unsigned int f = (unsigned int)format;
+    out.write((const char*)&f, sizeof(f));
+    out.write(binary.data(), length);
+}
+//--------------------------------------------------------------------------------
 void Shader::activate(void) const
 {
     assert(mIsValid);
@@ -101,7 +308,12 @@ void Shader::deactivate(void) const
 int Shader::getUniformLocation(const char* name) const
 {
     assert(mIsValid);
-    return glGetUniformLocation(mProgramID, name);
+    std::unordered_map<std::string,int>::iterator it = mUniformLocations.find(name);
+    if(it!=mUniformLocations.end())
+        return it->second;
+    int location = glGetUniformLocation(mProgramID, name);
+    mUniformLocations[name] = location;
+    return location;
 }
 //--------------------------------------------------------------------------------
 void Shader::setSamplerUnit(const char* sampler, int unit) const
@@ -3,6 +3,9 @@
 
 #include "opengl.h"
 #include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
 
 
 /** Permet de manipuler des shaders en GLSL
@@ -24,25 +27,54 @@
 class Shader
 {
 public:
+    /** Locations of the standard vertex attributes (vtx_position, vtx_normal, vtx_color, vtx_texcoord),
+        bound before linking: a vertex array object is thus valid for all the shaders. */
+    enum StandardAttrib { ATTRIB_POSITION = 0, ATTRIB_NORMAL, ATTRIB_COLOR, ATTRIB_TEXCOORD };
+
     Shader()
-      : mIsValid(false)
+      : mIsValid(false), mProgramID(0), mPendingProgramID(0)
     {}
+    ~Shader();
 
-    /** Compiles and links the shader from 2 source files
+    /** Compiles and links the shader from 2 or 3 source files
         \param fileV vertex shader ("" if no vertex shader)
         \param fileF fragment shader ("" if no fragment shader)
+        \param fileG geometry shader ("" if no geometry shader)
+        \param defines compile-time variant: each entry "NAME" or "NAME VALUE" is inserted as a #define after the #version line
         \return true if no error occurs
     */
-    bool loadFromFiles(const std::string& fileV, const std::string& fileF);
+    bool loadFromFiles(const std::string& fileV, const std::string& fileF, const std::string& fileG = "",
+                       const std::vector<std::string>& defines = std::vector<std::string>());
+
+    /** Compiles and links the shader from its sources, or loads it from the binary cache if enabled */
+    bool loadSources(const std::string& vsrc, const std::string& fsrc, const std::string& gsrc = "");
+
+    /** Enables the on-disk cache of linked programs (glGetProgramBinary) in the existing directory \a dir.
+        Entries are keyed by a hash of the sources and of the driver strings. "" disables the cache.
+    */
+    static void setCacheDirectory(const std::string& dir) { sCacheDirectory = dir; }
+
+    /** Starts recompiling the program from the files given to loadFromFiles(), without waiting for the driver
+        (using GL_KHR_parallel_shader_compile when available). The current program stays in use until
+        pollReload() swaps in the new one, which happens only if it links successfully.
+    */
+    void reload();
 
-    bool loadSources(const std::string& vsrc, const std::string& fsrc);
+    /** To be called every frame: if a reload is pending and the driver is done, swaps in the new program
+        and frees the old one.
+        \return true if the program has been replaced
+    */
+    bool pollReload();
+
+    /** \returns whether \a filename is one of the source files of this shader */
+    bool usesFile(const std::string& filename) const;
 
     /** Enable / Disable the shader
     */
     void activate() const;
     void deactivate() const;
 
-    /** \return the index of the uniform variable \a name
+    /** \return the index of the uniform variable \a name (cached, the program is only queried once per name)
     */
     int getUniformLocation(const char* name) const;
 
@@ -78,9 +110,37 @@ public:
 protected:
 
     bool mIsValid;
+
+    /** creates the pending program from the sources (or the binary cache) and starts linking it */
+    void startLoad(const std::string& vsrc, const std::string& fsrc, const std::string& gsrc);
+    /** \returns true if the driver is done with the pending program (never blocks) */
+    bool isLoadComplete() const;
+    /** checks the pending program, and replaces the current one if it linked successfully */
+    bool finishLoad();
+
+    /** compiles \a src and attaches it to \a programID, without waiting for the result */
+    static GLuint compileAndAttach(GLuint programID, GLenum type, const std::string& src);
+    static std::string injectDefines(const std::string& src, const std::vector<std::string>& defines);
+    static bool binaryCacheSupported();
+    static bool parallelCompileSupported();
+    bool loadBinary(GLuint programID, const std::string& filename);
+    static void saveBinary(GLuint programID, const std::string& filename);
+    static std::string sCacheDirectory;
     static void printProgramInfoLog(GLuint objectID);
     static void printShaderInfoLog(GLuint objectID);
     GLuint mProgramID;
+
+    // program being compiled
+    GLuint mPendingProgramID;
+    std::vector<GLuint> mPendingShaderIDs;
+    std::string mPendingCacheFile;
+    bool mPendingFromCache;
+
+    // source files, for reloads
+    std::string mFileV, mFileF, mFileG;
+    std::vector<std::string> mDefines;
+
+    mutable std::unordered_map<std::string,int> mUniformLocations;
 };
 
 #endif
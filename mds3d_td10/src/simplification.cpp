@@ -0,0 +1,262 @@
+#include "simplification.h"
+
+#include <surface_mesh/surface_mesh.h>
+#include <Eigen/Geometry>
+#include <map>
+#include <queue>
+#include <iostream>
+
+using namespace Eigen;
+using surface_mesh::Surface_mesh;
+
+namespace {
+
+/** lexicographic order, to weld vertices sharing the same position */
+struct PositionCompare
+{
+    bool operator()(const Vector3f& a, const Vector3f& b) const
+    {
+        if(a.x()!=b.x()) return a.x()<b.x();
+        if(a.y()!=b.y()) return a.y()<b.y();
+        return a.z()<b.z();
+    }
+};
+
+/** A candidate halfedge collapse, with the stamps of its end-points at the time it was evaluated */
+struct Candidate
+{
+    float cost;
+    Surface_mesh::Halfedge h;
+    int stamp0, stamp1;
+    bool operator<(const Candidate& other) const { return cost > other.cost; } // smallest cost first
+};
+
+class Simplifier
+{
+public:
+    Simplifier(const std::vector<Vector3f>& positions, const std::vector<Vector3f>& normals, const std::vector<Vector3i>& faces)
+        : mNormals(normals)
+    {
+        // weld the vertices by position
+        std::map<Vector3f,int,PositionCompare> ids;
+        mWeldId.resize(positions.size());
+        for(std::size_t i=0; i<positions.size(); ++i)
+        {
+            std::map<Vector3f,int,PositionCompare>::iterator it = ids.find(positions[i]);
+            if(it==ids.end())
+            {
+                it = ids.insert(std::make_pair(positions[i], int(mCopies.size()))).first;
+                mMesh.add_vertex(positions[i]);
+                mCopies.push_back(std::vector<int>());
+            }
+            mWeldId[i] = it->second;
+            mCopies[it->second].push_back(int(i));
+        }
+
+        // build the halfedge structure, keeping track of the original corners of each face
+        for(std::size_t f=0; f<faces.size(); ++f)
+        {
+            Surface_mesh::Vertex v0(mWeldId[faces[f][0]]), v1(mWeldId[faces[f][1]]), v2(mWeldId[faces[f][2]]);
+            if(v0==v1 || v1==v2 || v2==v0)
+                continue; // degenerated
+            Surface_mesh::Face face = mMesh.add_triangle(v0, v1, v2);
+            if(face.is_valid())
+                mCorners.push_back(faces[f]);
+            else
+                mFixedFaces.push_back(faces[f]); // non-manifold, kept as is in all levels
+        }
+
+        // fundamental error quadrics, weighted by the face areas
+        mQuadrics.assign(mMesh.vertices_size(), Matrix4d::Zero());
+        for(unsigned int f=0; f<mMesh.faces_size(); ++f)
+        {
+            Surface_mesh::Halfedge h = mMesh.halfedge(Surface_mesh::Face(f));
+            Vector3d p0 = mMesh.position(mMesh.from_vertex(h)).cast<double>();
+            Vector3d p1 = mMesh.position(mMesh.to_vertex(h)).cast<double>();
+            Vector3d p2 = mMesh.position(mMesh.to_vertex(mMesh.next_halfedge(h))).cast<double>();
+            Vector3d n = (p1-p0).cross(p2-p0);
+            double area2 = n.norm();
+            if(area2<=0)
+                continue;
+            n /= area2;
+            Vector4d plane(n.x(), n.y(), n.z(), -n.dot(p0));
+            Matrix4d K = 0.5*area2 * plane * plane.transpose();
+            for(int k=0; k<3; ++k)
+            {
+                mQuadrics[mMesh.from_vertex(h).idx()] += K;
+                h = mMesh.next_halfedge(h);
+            }
+        }
+
+        mStamps.assign(mMesh.vertices_size(), 0);
+        for(unsigned int i=0; i<mMesh.halfedges_size(); ++i)
+            push(Surface_mesh::Halfedge(i));
+    }
+
+    /** collapses edges until at most \a targetFaces remain, \returns false if no more collapse is possible */
+    bool decimate(unsigned int targetFaces)
+    {
+        while(mMesh.n_faces()+mFixedFaces.size() > targetFaces)
+        {
+            if(mQueue.empty())
+                return false;
+            Candidate c = mQueue.top();
+            mQueue.pop();
+
+            Surface_mesh::Halfedge h = c.h;
+            if(mMesh.is_deleted(h))
+                continue;
+            Surface_mesh::Vertex v0 = mMesh.from_vertex(h), v1 = mMesh.to_vertex(h);
+            if(c.stamp0!=mStamps[v0.idx()] || c.stamp1!=mStamps[v1.idx()])
+                continue; // outdated
+            if(!isCollapseOk(h))
+                continue;
+            collapse(h);
+        }
+        return true;
+    }
+
+    /** \returns the current faces, as triangles of the original vertices */
+    void extract(std::vector<Vector3i>& faces) const
+    {
+        faces = mFixedFaces;
+        faces.reserve(mMesh.n_faces()+mFixedFaces.size());
+        for(unsigned int f=0; f<mMesh.faces_size(); ++f)
+            if(!mMesh.is_deleted(Surface_mesh::Face(f)))
+                faces.push_back(mCorners[f]);
+    }
+
+    unsigned int nbFaces() const { return mMesh.n_faces() + mFixedFaces.size(); }
+
+private:
+
+    float cost(Surface_mesh::Halfedge h) const
+    {
+        Surface_mesh::Vertex v0 = mMesh.from_vertex(h), v1 = mMesh.to_vertex(h);
+        Vector4d p;
+        p << mMesh.position(v1).cast<double>(), 1.;
+        return float(p.dot((mQuadrics[v0.idx()]+mQuadrics[v1.idx()])*p));
+    }
+
+    void push(Surface_mesh::Halfedge h)
+    {
+        // boundaries (including attribute seams not sharing positions) are preserved
+        if(mMesh.is_deleted(h) || mMesh.is_boundary(mMesh.from_vertex(h)))
+            return;
+        Candidate c;
+        c.h = h;
+        c.cost = cost(h);
+        c.stamp0 = mStamps[mMesh.from_vertex(h).idx()];
+        c.stamp1 = mStamps[mMesh.to_vertex(h).idx()];
+        mQueue.push(c);
+    }
+
+    /** topological check plus rejection of collapses flipping or degenerating the faces around the removed vertex */
+    bool isCollapseOk(Surface_mesh::Halfedge h)
+    {
+        if(!mMesh.is_collapse_ok(h))
+            return false;
+        Surface_mesh::Vertex v0 = mMesh.from_vertex(h), v1 = mMesh.to_vertex(h);
+        const Vector3f& p1 = mMesh.position(v1);
+        Surface_mesh::Halfedge_around_vertex_circulator hc = mMesh.halfedges(v0), hc_end = hc;
+        do
+        {
+            Surface_mesh::Halfedge hf = *hc;
+            if(mMesh.is_boundary(hf))
+                continue;
+            Surface_mesh::Vertex va = mMesh.to_vertex(hf);
+            Surface_mesh::Vertex vb = mMesh.to_vertex(mMesh.next_halfedge(hf));
+            if(va==v1 || vb==v1)
+                continue; // removed by the collapse
+            const Vector3f& p0 = mMesh.position(v0);
+            const Vector3f& pa = mMesh.position(va);
+            const Vector3f& pb = mMesh.position(vb);
+            Vector3f n0 = (pa-p0).cross(pb-p0);
+            Vector3f n1 = (pa-p1).cross(pb-p1);
+            if(n1.squaredNorm() < 1e-12f*n0.squaredNorm() || n0.dot(n1) < 0.2f*n0.norm()*n1.norm())
+                return false;
+        }
+        while(++hc != hc_end);
+        return true;
+    }
+
+    void collapse(Surface_mesh::Halfedge h)
+    {
+        Surface_mesh::Vertex v0 = mMesh.from_vertex(h), v1 = mMesh.to_vertex(h);
+
+        // the corners referring to a copy of v0 now refer to the copy of v1 having the closest normal
+        Surface_mesh::Face_around_vertex_circulator fc = mMesh.faces(v0), fc_end = fc;
+        do
+        {
+            Vector3i& corners = mCorners[(*fc).idx()];
+            for(int k=0; k<3; ++k)
+            {
+                if(mWeldId[corners[k]]!=v0.idx())
+                    continue;
+                const std::vector<int>& copies = mCopies[v1.idx()];
+                int best = copies[0];
+                float bestDot = -2;
+                for(std::size_t i=0; i<copies.size(); ++i)
+                {
+                    float d = mNormals[copies[i]].dot(mNormals[corners[k]]);
+                    if(d>bestDot)
+                    {
+                        bestDot = d;
+                        best = copies[i];
+                    }
+                }
+                corners[k] = best;
+            }
+        }
+        while(++fc != fc_end);
+
+        mMesh.collapse(h);
+        mQuadrics[v1.idx()] += mQuadrics[v0.idx()];
+        mStamps[v1.idx()]++;
+
+        // re-evaluate the halfedges adjacent to v1
+        Surface_mesh::Halfedge_around_vertex_circulator hc = mMesh.halfedges(v1), hc_end = hc;
+        if(!hc)
+            return; // isolated
+        do
+        {
+            push(*hc);
+            push(mMesh.opposite_halfedge(*hc));
+        }
+        while(++hc != hc_end);
+    }
+
+    Surface_mesh mMesh;
+    const std::vector<Vector3f>& mNormals;
+    std::vector<int> mWeldId;               ///< original vertex -> welded vertex
+    std::vector< std::vector<int> > mCopies; ///< welded vertex -> original vertices
+    std::vector<Vector3i> mCorners;          ///< Surface_mesh face -> original vertices
+    std::vector<Vector3i> mFixedFaces;
+    std::vector<Matrix4d, aligned_allocator<Matrix4d> > mQuadrics;
+    std::vector<int> mStamps;
+    std::priority_queue<Candidate> mQueue;
+};
+
+} // namespace
+
+void buildLODChain(const std::vector<Vector3f>& positions,
+                   const std::vector<Vector3f>& normals,
+                   const std::vector<Vector3i>& faces,
+                   int nbLevels, float ratio,
+                   std::vector< std::vector<Vector3i> >& levels)
+{
+    levels.clear();
+    Simplifier simplifier(positions, normals, faces);
+
+    float target = float(faces.size());
+    for(int l=0; l<nbLevels; ++l)
+    {
+        target *= ratio;
+        unsigned int before = simplifier.nbFaces();
+        simplifier.decimate((unsigned int)(target));
+        if(simplifier.nbFaces()==before)
+            break; // stuck, no need for more levels
+        levels.push_back(std::vector<Vector3i>());
+        simplifier.extract(levels.back());
+    }
+}
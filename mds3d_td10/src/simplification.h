@@ -0,0 +1,25 @@
+#ifndef SIMPLIFICATION_H
+#define SIMPLIFICATION_H
+
+#include <Eigen/Core>
+#include <vector>
+
+/** Builds a chain of simplified versions of a triangle mesh using quadric error metrics
+  * and halfedge collapses (Garland & Heckbert), on top of surface_mesh::Surface_mesh.
+  *
+  * Vertices are never moved nor created: the level \a l (1<=l<=nbLevels) only contains about
+  * \a ratio^l times the input faces, as triangles indexing the original vertices. All levels can thus share
+  * the same vertex buffer. Vertices with identical positions (attribute seams) are welded during the
+  * simplification, and corners are remapped to the copy having the closest normal.
+  *
+  * \param positions, normals the vertex attributes
+  * \param faces the input triangles
+  * \param levels output index lists, levels[l-1] being the level l
+  */
+void buildLODChain(const std::vector<Eigen::Vector3f>& positions,
+                   const std::vector<Eigen::Vector3f>& normals,
+                   const std::vector<Eigen::Vector3i>& faces,
+                   int nbLevels, float ratio,
+                   std::vector< std::vector<Eigen::Vector3i> >& levels);
+
+#endif // SIMPLIFICATION_H
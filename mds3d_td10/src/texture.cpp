@@ -0,0 +1,236 @@
+#include "texture.h"
+#include "opengl.h"
+#include "SOIL2.h"
+#include "image_helper.h"
+#include "hash.h"
+#include <glbinding/gl/enum.h>
+
+extern "C" {
+#include "image_DXT.h"
+}
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+
+namespace {
+
+std::string cacheDirectory;
+
+const char cacheMagic[4] = {'T','E','X','C'};
+const int cacheVersion = 1;
+
+/** header of the cache files, followed by the size and the data of each level */
+struct CacheHeader
+{
+    char magic[4];
+    int version;
+    long long sourceSize, sourceTime; // to detect modifications of the source image
+    int width, height, channels, compressed, nbLevels;
+};
+
+std::string cacheFileName(const std::string& filename, bool compress)
+{
+    // hash of the path and of the options
+    unsigned long long hash = hashString(filename + (compress ? "|dxt" : "|raw"));
+    std::ostringstream name;
+    name << cacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".tex";
+    return name.str();
+}
+
+bool readCache(const std::string& cacheFile, const struct stat& source, TextureData& data)
+{
+    std::ifstream in(cacheFile.c_str(), std::ios::in | std::ios::binary);
+    if(!in)
+        return false;
+    CacheHeader header;
+    if(!in.read((char*)&header, sizeof(header))
+       || std::memcmp(header.magic, cacheMagic, 4)!=0 || header.version!=cacheVersion
+       || header.sourceSize!=(long long)source.st_size || header.sourceTime!=(long long)source.st_mtime)
+        return false;
+
+    data.width = header.width;
+    data.height = header.height;
+    data.channels = header.channels;
+    data.compressed = header.compressed!=0;
+    data.levels.resize(header.nbLevels);
+    for(int l=0; l<header.nbLevels; ++l)
+    {
+        int size;
+        if(!in.read((char*)&size, sizeof(size)) || size<=0)
+            return false;
+        data.levels[l].resize(size);
+        if(!in.read((char*)data.levels[l].data(), size))
+            return false;
+    }
+    return true;
+}
+
+void writeCache(const std::string& cacheFile, const struct stat& source, const TextureData& data)
+{
+    std::ofstream out(cacheFile.c_str(), std::ios::out | std::ios::binary);
+    if(!out)
+    {
+        std::cerr << "Texture: cannot write the cache file " << cacheFile << std::endl;
+        return;
+    }
+    CacheHeader header;
+    std::memcpy(header.magic, cacheMagic, 4);
+    header.version = cacheVersion;
+    header.sourceSize = source.st_size;
+    header.sourceTime = source.st_mtime;
+    header.width = data.width;
+    header.height = data.height;
+    header.channels = data.channels;
+    header.compressed = data.compressed;
+    header.nbLevels = int(data.levels.size());
+    out.write((const char*)&header, sizeof(header));
+    for(std::size_t l=0; l<data.levels.size(); ++l)
+    {
+        int size = int(data.levels[l].size());
+        out.write((const char*)&size, sizeof(size));
+        out.write((const char*)data.levels[l].data(), size);
+    }
+}
+
+/** decodes \a filename as 8 bits RGB or RGBA pixels */
+bool decodeImage(const std::string& filename, int& width, int& height, int& channels, std::vector<unsigned char>& pixels)
+{
+    unsigned char* image = SOIL_load_image(filename.c_str(), &width, &height, &channels, SOIL_LOAD_AUTO);
+    if(!image)
+    {
+        std::cerr << "Texture: cannot load " << filename << ": " << SOIL_last_result() << std::endl;
+        return false;
+    }
+    // expand the luminance images, and drop the alpha channel if it is not used
+    bool hasAlpha = false;
+    int n = width*height;
+    if(channels==2 || channels==4)
+        for(int i=0; i<n && !hasAlpha; ++i)
+            hasAlpha = image[i*channels + channels-1]!=255;
+    int outChannels = hasAlpha ? 4 : 3;
+    pixels.resize(n*outChannels);
+    for(int i=0; i<n; ++i)
+    {
+        const unsigned char* src = image + i*channels;
+        unsigned char* dst = &pixels[i*outChannels];
+        for(int c=0; c<3; ++c)
+            dst[c] = channels<3 ? src[0] : src[c];
+        if(hasAlpha)
+            dst[3] = src[channels-1];
+    }
+    SOIL_free_image_data(image);
+    channels = outChannels;
+    return true;
+}
+
+} // namespace
+
+void setTextureCacheDirectory(const std::string& dir)
+{
+    cacheDirectory = dir;
+}
+
+bool loadTextureData(const std::string& filename, bool compress, TextureData& data)
+{
+    struct stat source;
+    if(stat(filename.c_str(), &source)!=0)
+    {
+        std::cerr << "Texture: file not found " << filename << std::endl;
+        return false;
+    }
+
+    std::string cacheFile;
+    if(!cacheDirectory.empty())
+    {
+        cacheFile = cacheFileName(filename, compress);
+        if(readCache(cacheFile, source, data))
+            return true;
+    }
+
+    std::vector<unsigned char> pixels;
+    if(!decodeImage(filename, data.width, data.height, data.channels, pixels))
+        return false;
+    data.compressed = compress;
+    data.levels.clear();
+
+    // box filtered mipmap chain, down to 1x1
+    int w = data.width, h = data.height;
+    while(true)
+    {
+        if(compress)
+        {
+            int size = 0;
+            unsigned char* dxt = data.channels==3
+                ? convert_image_to_DXT1(pixels.data(), w, h, data.channels, &size)
+                : convert_image_to_DXT5(pixels.data(), w, h, data.channels, &size);
+            data.levels.push_back(std::vector<unsigned char>(dxt, dxt+size));
+            free(dxt);
+        }
+        else
+        {
+            data.levels.push_back(pixels);
+        }
+        if(w==1 && h==1)
+            break;
+        std::vector<unsigned char> mip(std::max(1,w/2)*std::max(1,h/2)*data.channels);
+        mipmap_image(pixels.data(), w, h, data.channels, mip.data(), 2, 2);
+        pixels.swap(mip);
+        w = std::max(1,w/2);
+        h = std::max(1,h/2);
+    }
+
+    if(!cacheFile.empty())
+        writeCache(cacheFile, source, data);
+    return true;
+}
+
+unsigned int uploadTexture(const TextureData& data)
+{
+    if(data.levels.empty())
+        return 0;
+    GLuint id;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D, id);
+
+    GLenum format = data.channels==3 ? GL_RGB : GL_RGBA;
+    GLenum compressedFormat = data.channels==3 ? gl::GL_COMPRESSED_RGB_S3TC_DXT1_EXT : gl::GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    int w = data.width, h = data.height;
+    for(std::size_t l=0; l<data.levels.size(); ++l)
+    {
+        if(data.compressed)
+            glCompressedTexImage2D(GL_TEXTURE_2D, GLint(l), compressedFormat, w, h, 0,
+                                   GLsizei(data.levels[l].size()), data.levels[l].data());
+        else
+            glTexImage2D(GL_TEXTURE_2D, GLint(l), GLint(format), w, h, 0, format, GL_UNSIGNED_BYTE, data.levels[l].data());
+        w = std::max(1,w/2);
+        h = std::max(1,h/2);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(data.levels.size())-1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GLint(GL_LINEAR_MIPMAP_LINEAR));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GLint(GL_LINEAR));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GLint(GL_CLAMP_TO_EDGE));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GLint(GL_CLAMP_TO_EDGE));
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return id;
+}
+
+bool textureCompressionSupported()
+{
+    int nbExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &nbExtensions);
+    for(int i=0; i<nbExtensions; ++i)
+    {
+        if(std::string((const char*)glGetStringi(GL_EXTENSIONS, i))=="GL_EXT_texture_compression_s3tc")
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,36 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <string>
+#include <vector>
+
+/** A 2D texture with its whole mipmap chain, ready to be sent to OpenGL */
+struct TextureData
+{
+    int width, height;  ///< size of the level 0
+    int channels;       ///< 3 (RGB) or 4 (RGBA)
+    bool compressed;    ///< DXT1 if channels==3, DXT5 otherwise
+    std::vector< std::vector<unsigned char> > levels;
+};
+
+/** Sets the directory where loadTextureData() stores the processed textures, empty (the default) disables the cache */
+void setTextureCacheDirectory(const std::string& dir);
+
+/** Decodes the image \a filename, builds its mipmaps and, if \a compress is true, converts them to DXT
+  * (using SOIL's image_DXT). RGBA images that are fully opaque are stored as RGB (DXT1).
+  * The result is saved in the cache directory, and directly read back by the next calls as long as
+  * the source file is not modified.
+  * This does not call OpenGL, and can be run on a worker thread.
+  * \return false if the image cannot be read
+  */
+bool loadTextureData(const std::string& filename, bool compress, TextureData& data);
+
+/** Creates an OpenGL texture from \a data (trilinear filtering, clamped to edges).
+  * \return the texture id, or 0 on failure */
+unsigned int uploadTexture(const TextureData& data);
+
+/** \returns whether the driver supports DXT compressed textures (GL_EXT_texture_compression_s3tc),
+  * needs a current OpenGL context */
+bool textureCompressionSupported();
+
+#endif // TEXTURE_H
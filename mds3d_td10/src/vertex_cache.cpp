@@ -0,0 +1,166 @@
+#include "vertex_cache.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+
+float computeACMR(const Vector3i* faces, int nbFaces, int cacheSize)
+{
+    if(nbFaces==0)
+        return 0;
+    std::vector<int> fifo(cacheSize, -1);
+    int head = 0, misses = 0;
+    for(int f=0; f<nbFaces; ++f)
+    {
+        for(int k=0; k<3; ++k)
+        {
+            int v = faces[f][k];
+            if(std::find(fifo.begin(), fifo.end(), v)==fifo.end())
+            {
+                fifo[head] = v;
+                head = (head+1)%cacheSize;
+                ++misses;
+            }
+        }
+    }
+    return float(misses)/float(nbFaces);
+}
+
+namespace {
+
+const int   kCacheSize          = 32;
+const float kCacheDecayPower    = 1.5f;
+const float kLastTriScore       = 0.75f;
+const float kValenceBoostScale  = 2.0f;
+const float kValenceBoostPower  = 0.5f;
+
+float vertexScore(int cachePosition, int nbRemainingFaces)
+{
+    if(nbRemainingFaces==0)
+        return -1.f; // no more triangle needs this vertex
+
+    float score = 0.f;
+    if(cachePosition>=0)
+    {
+        if(cachePosition<3)
+            score = kLastTriScore; // used by the last triangle: fixed score whatever its corner
+        else
+            score = std::pow(1.f - float(cachePosition-3)/float(kCacheSize-3), kCacheDecayPower);
+    }
+    // boost vertices with few remaining triangles, to get rid of them first
+    score += kValenceBoostScale * std::pow(float(nbRemainingFaces), -kValenceBoostPower);
+    return score;
+}
+
+} // namespace
+
+void optimizeFaceOrder(const Vector3i* faces, int nbFaces, int nbVertices, std::vector<int>& order)
+{
+    order.clear();
+    order.reserve(nbFaces);
+
+    // vertex -> faces adjacency, the first nbRemaining[v] entries being the faces not emitted yet
+    std::vector<int> adjOffsets(nbVertices+1, 0);
+    for(int f=0; f<nbFaces; ++f)
+        for(int k=0; k<3; ++k)
+            adjOffsets[faces[f][k]+1]++;
+    for(int v=0; v<nbVertices; ++v)
+        adjOffsets[v+1] += adjOffsets[v];
+    std::vector<int> adjacency(adjOffsets[nbVertices]);
+    std::vector<int> nbRemaining(nbVertices, 0);
+    for(int f=0; f<nbFaces; ++f)
+        for(int k=0; k<3; ++k)
+        {
+            int v = faces[f][k];
+            adjacency[adjOffsets[v] + nbRemaining[v]++] = f;
+        }
+
+    std::vector<int> cachePosition(nbVertices, -1);
+    std::vector<float> score(nbVertices, 0.f);
+    for(int f=0; f<nbFaces; ++f)
+        for(int k=0; k<3; ++k)
+            score[faces[f][k]] = vertexScore(-1, nbRemaining[faces[f][k]]);
+
+    std::vector<float> faceScore(nbFaces);
+    std::vector<bool> emitted(nbFaces, false);
+    for(int f=0; f<nbFaces; ++f)
+        faceScore[f] = score[faces[f][0]] + score[faces[f][1]] + score[faces[f][2]];
+
+    std::vector<int> cache, newCache;
+    cache.reserve(kCacheSize+3);
+    newCache.reserve(kCacheSize+3);
+    int bestFace = nbFaces>0 ? int(std::max_element(faceScore.begin(), faceScore.end()) - faceScore.begin()) : -1;
+    int cursor = 0; // to find a new starting face when the cache does not lead anywhere
+
+    while(bestFace>=0)
+    {
+        order.push_back(bestFace);
+        emitted[bestFace] = true;
+
+        // remove the face from the adjacency of its vertices, and push them on top of the LRU cache
+        newCache.clear();
+        for(int k=0; k<3; ++k)
+        {
+            int v = faces[bestFace][k];
+            int* adj = &adjacency[adjOffsets[v]];
+            int* last = adj + nbRemaining[v];
+            std::iter_swap(std::find(adj, last, bestFace), last-1);
+            nbRemaining[v]--;
+            newCache.push_back(v);
+        }
+        for(std::size_t i=0; i<cache.size(); ++i)
+            if(cache[i]!=faces[bestFace][0] && cache[i]!=faces[bestFace][1] && cache[i]!=faces[bestFace][2])
+                newCache.push_back(cache[i]);
+
+        // update the scores of the vertices in the cache (including the ones just evicted)
+        for(std::size_t i=0; i<newCache.size(); ++i)
+        {
+            int v = newCache[i];
+            cachePosition[v] = i<std::size_t(kCacheSize) ? int(i) : -1;
+            score[v] = vertexScore(cachePosition[v], nbRemaining[v]);
+        }
+        if(newCache.size()>std::size_t(kCacheSize))
+            newCache.resize(kCacheSize);
+        cache.swap(newCache);
+
+        // the next face is the best one among the faces touching the cache
+        bestFace = -1;
+        float bestScore = -1e30f;
+        for(std::size_t i=0; i<cache.size(); ++i)
+        {
+            int v = cache[i];
+            for(int j=0; j<nbRemaining[v]; ++j)
+            {
+                int f = adjacency[adjOffsets[v]+j];
+                faceScore[f] = score[faces[f][0]] + score[faces[f][1]] + score[faces[f][2]];
+                if(faceScore[f]>bestScore)
+                {
+                    bestScore = faceScore[f];
+                    bestFace = f;
+                }
+            }
+        }
+        if(bestFace<0)
+        {
+            // dead end: restart from the next face not emitted yet
+            while(cursor<nbFaces && emitted[cursor])
+                ++cursor;
+            if(cursor<nbFaces)
+                bestFace = cursor;
+        }
+    }
+}
+
+void computeVertexFetchRemap(const std::vector<Vector3i>& faces, int nbVertices, std::vector<int>& remap)
+{
+    remap.assign(nbVertices, -1);
+    int next = 0;
+    for(std::size_t f=0; f<faces.size(); ++f)
+        for(int k=0; k<3; ++k)
+            if(remap[faces[f][k]]<0)
+                remap[faces[f][k]] = next++;
+    for(int v=0; v<nbVertices; ++v)
+        if(remap[v]<0)
+            remap[v] = next++;
+}
@@ -0,0 +1,25 @@
+#ifndef VERTEX_CACHE_H
+#define VERTEX_CACHE_H
+
+#include <Eigen/Core>
+#include <vector>
+
+/** \returns the average cache miss ratio (number of vertex shader invocations per triangle)
+  * of the triangles \a faces, simulating a FIFO post-transform cache of \a cacheSize entries.
+  * It is 3 without any reuse, and tends to 0.5 for ideal regular meshes.
+  */
+float computeACMR(const Eigen::Vector3i* faces, int nbFaces, int cacheSize = 16);
+
+/** Reorders the triangles [faces, faces+nbFaces) to improve the post-transform vertex cache hit rate,
+  * using Tom Forsyth's "Linear-speed vertex cache optimisation" with a LRU cache of 32 entries.
+  * Vertex indices must be in [0,nbVertices).
+  * \param order output permutation: order[i] is the index (relative to \a faces) of the i-th face in the new order
+  */
+void optimizeFaceOrder(const Eigen::Vector3i* faces, int nbFaces, int nbVertices, std::vector<int>& order);
+
+/** Computes a new vertex order following the first use of the vertices by \a faces.
+  * \param remap output, remap[old_index] is the new index of each vertex (unused vertices are moved at the end)
+  */
+void computeVertexFetchRemap(const std::vector<Eigen::Vector3i>& faces, int nbVertices, std::vector<int>& remap);
+
+#endif // VERTEX_CACHE_H
@@ -1,14 +1,35 @@
 #include "viewer.h"
-#include "SOIL2.h"
 #include "camera.h"
+#include "asset_loader.h"
+#include "texture.h"
 
 using namespace Eigen;
 
-Viewer::Viewer() : _winWidth(0), _winHeight(0), _wireframe(false) {
+namespace {
+
+// collision proxies of the arm: the joint mesh is a unit sphere, the segment mesh a unit cylinder of radius ~0.11
+const float jointScale = 0.2f;
+const float segmentRadius = 0.11f;
+
+// contact resolution of the IK: projection passes per frame, and clearance kept with _scene
+const int maxContactIterations = 4;
+const float contactMargin = 0.005f;
+
+} // namespace
+
+Viewer::Viewer()
+    : _winWidth(0), _winHeight(0), _wireframe(false), _culling(true),
+      _useLODs(true) {
   _IK_target.setZero();
+  _emptyVAO = 0;
+  _activeShader = &_shader;
+  _gridResolution = Vector2i(128, 128);
 }
 
-Viewer::~Viewer() {}
+Viewer::~Viewer() {
+  if (_emptyVAO)
+    glDeleteVertexArrays(1, &_emptyVAO);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // GL stuff
@@ -19,34 +40,55 @@ void Viewer::init(int w, int h) {
   // Background color
   glClearColor(1.0, 1.0, 1.0, 0.0);
 
+  Shader::setCacheDirectory(SHADER_CACHE_DIR);
+  setTextureCacheDirectory(TEXTURE_CACHE_DIR);
   loadShaders();
-
-  if (!_scene.load(DATA_DIR "/models/scene.obj"))
-    exit(1);
-  _scene.init();
-
-  if (!_jointMesh.load(DATA_DIR "/models/joint.obj"))
-    exit(1);
-  _jointMesh.init();
-
-  if (!_sphere.load(DATA_DIR "/models/sphere.obj"))
-    exit(1);
-  _sphere.init();
-
-  if (!_segmentMesh.load(DATA_DIR "/models/segment.obj"))
+  _shaderWatcher.watch(DATA_DIR "/shaders");
+
+  // meshes and textures are parsed and processed in parallel,
+  // and sent to OpenGL on this thread as soon as each of them is ready
+  AssetLoader loader;
+  auto addMesh = [&loader](Mesh &mesh, const std::string &name, bool lods) {
+    loader.add(name,
+               [&mesh, name, lods]() {
+                 if (!mesh.load(DATA_DIR "/models/" + name))
+                   return false;
+                 mesh.setVertexFormat(Mesh::VF_QUANTIZED);
+                 if (lods)
+                   mesh.buildLODs();
+                 mesh.prepare();
+                 return true;
+               },
+               [&mesh]() { mesh.upload(); });
+  };
+  // picking rays are cast against the scene: worth a better BVH
+  _scene.setBVHSpatialSplits(0.3f);
+  _scene.setBVHOptimization(true);
+  addMesh(_scene, "scene.obj", true);
+  addMesh(_jointMesh, "joint.obj", true);
+  addMesh(_sphere, "sphere.obj", true);
+  addMesh(_segmentMesh, "segment.obj", false);
+
+  // decoded, mipmapped and compressed once, then read back from the cache
+  TextureData texData;
+  bool compress = textureCompressionSupported();
+  _texid = 0;
+  loader.add("rainbow.png",
+             [&texData, compress]() {
+               loadTextureData(DATA_DIR "/textures/rainbow.png", compress,
+                               texData);
+               return true; // a missing texture is reported below
+             },
+             [this, &texData]() { _texid = uploadTexture(texData); });
+
+  if (!loader.run())
     exit(1);
-  _segmentMesh.init();
 
-  if (!_grid.load(DATA_DIR "/models/grid.obj"))
-    exit(1);
-  _grid.init();
-
-  _texid =
-      SOIL_load_OGL_texture(DATA_DIR "/textures/rainbow.png", SOIL_LOAD_AUTO,
-                            SOIL_CREATE_NEW_ID, SOIL_FLAG_MIPMAPS);
+  // attribute-less draws still need a bound VAO in a core profile
+  glGenVertexArrays(1, &_emptyVAO);
 
   if (0 == _texid) {
-    printf("SOIL loading error: '%s'\n", SOIL_last_result());
+    printf("Texture loading error\n");
   }
 
   reshape(w, h);
@@ -78,57 +120,46 @@ void Viewer::drawScene() {
   // configure the rendering target size (viewport)
   glViewport(0, 0, _winWidth, _winHeight);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  
-  _shader.activate();
 
-  glUniform1i(_shader.getUniformLocation("wireframe"), 0);
-  glUniformMatrix4fv(_shader.getUniformLocation("view_mat"), 1, GL_FALSE,
+  _viewProj = _cam.projectionMatrix() * _cam.viewMatrix();
+  _cullingStats.reset();
+
+  // the wireframe variant shades the edges in the same pass
+  _activeShader = _wireframe ? &_wireframeShader : &_shader;
+  Shader &shader = *_activeShader;
+  shader.activate();
+
+  if (_wireframe)
+    glUniform2f(shader.getUniformLocation("viewport"), float(_winWidth),
+                float(_winHeight));
+  glUniformMatrix4fv(shader.getUniformLocation("view_mat"), 1, GL_FALSE,
                      _cam.viewMatrix().data());
-  glUniformMatrix4fv(_shader.getUniformLocation("proj_mat"), 1, GL_FALSE,
+  glUniformMatrix4fv(shader.getUniformLocation("proj_mat"), 1, GL_FALSE,
                      _cam.projectionMatrix().data());
 
   Vector3f lightDir = Vector3f(1, 0, 1).normalized();
   lightDir = (_cam.viewMatrix().topLeftCorner<3, 3>() * lightDir).normalized();
-  glUniform3fv(_shader.getUniformLocation("lightDir"), 1, lightDir.data());
+  glUniform3fv(shader.getUniformLocation("lightDir"), 1, lightDir.data());
+
+  // the objects are collected, then drawn sorted by state
+  _renderQueue.clear();
 
   Affine3f M;
   M.setIdentity();
-  setObjectMatrix(_shader, M.matrix());
-  glUniform3fv(_shader.getUniformLocation("color"), 1,
-               Vector3f(0.4, 0.4, 0.8).data());
-  _scene.draw(_shader);
+  drawMesh(_scene, M.matrix(), Vector3f(0.4, 0.4, 0.8));
 
   drawArticulatedArm();
 
   // draw target if defined:
   if (_IK_target.norm() > 0) {
-    setObjectMatrix(_shader,
-                    (M * Translation3f(_IK_target) * Scaling(0.2f)).matrix());
-    glUniform3fv(_shader.getUniformLocation("color"), 1,
-                 Vector3f(0.4f, 0.8f, 0.4f).data());
-    _sphere.draw(_shader);
+    drawMesh(_sphere, (M * Translation3f(_IK_target) * Scaling(0.2f)).matrix(),
+             Vector3f(0.4f, 0.8f, 0.4f));
   }
 
-  if (_wireframe) {
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glEnable(GL_LINE_SMOOTH);
-    glDepthFunc(GL_LEQUAL);
-    glUniform1i(_shader.getUniformLocation("wireframe"), 1);
+  _renderQueue.execute(_cam.viewMatrix(), _culling ? &_viewProj : 0,
+                       &_cullingStats);
 
-    Affine3f M1;
-    M1.setIdentity();
-    setObjectMatrix(_shader, M1.matrix());
-    glUniform3fv(_shader.getUniformLocation("color"), 1,
-                 Vector3f(0.4f, 0.4f, 0.8f).data());
-    _scene.draw(_shader);
-
-    drawArticulatedArm();
-
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    glUniform1i(_shader.getUniformLocation("wireframe"), 0);
-  }
-
-  _shader.deactivate();
+  shader.deactivate();
 }
 
 void Viewer::setObjectMatrix(Shader &shader, const Matrix4f &M) const {
@@ -140,6 +171,38 @@ void Viewer::setObjectMatrix(Shader &shader, const Matrix4f &M) const {
                      matN.data());
 }
 
+/*!
+   draws \a mesh with the object matrix \a M, unless its bounding box is
+   outside the view frustum. Clusters of large meshes are culled as well, and
+   the level of detail is chosen from the projected size of the mesh.
+ */
+void Viewer::drawMesh(Mesh &mesh, const Matrix4f &M, const Vector3f &color) {
+  // frustum planes expressed in the object space of the mesh
+  Frustum frustum(_viewProj * M);
+  if (_culling && !frustum.intersects(mesh.boundingBox())) {
+    _cullingStats.objectsCulled++;
+    return;
+  }
+  _cullingStats.objectsVisible++;
+
+  // projected diameter of the bounding sphere, to select the level of detail
+  int lod = 0;
+  if (_useLODs) {
+    const AlignedBox3f &box = mesh.boundingBox();
+    float radius = 0.5f * box.diagonal().norm() *
+                   M.topLeftCorner<3, 3>().colwise().norm().maxCoeff();
+    Vector4f c = _cam.viewMatrix() * M * box.center().homogeneous();
+    float dist = -c.z();
+    if (dist > radius) {
+      float screenSize =
+          radius * _cam.projectionMatrix()(1, 1) / dist * float(_winHeight);
+      lod = mesh.selectLOD(screenSize);
+    }
+  }
+
+  _renderQueue.submit(*_activeShader, mesh, Material(color), M, lod);
+}
+
 /* Usefull functions :
 
 Affine3f M;
@@ -171,28 +234,21 @@ void Viewer::drawArticulatedArm() {
   Affine3f M;
   M.setIdentity();
 
-  // facteur d'échelle uniforme pour tracer les joints
-  float jointScale = 0.2f;
-
   int n = int(_lengths.size()); // number of segments
   for (int i = 0; i < n; ++i) {
 
     // Draw joint.
     M = M * AngleAxisf(_jointAngles(0, i), Vector3f::UnitZ());
-    setObjectMatrix(_shader, (M * Scaling(jointScale)).matrix());
-    glUniform3fv(_shader.getUniformLocation("color"), 1,
-                 Vector3f(0.8f, 0.4f, 0.4f).data());
-    _jointMesh.draw(_shader);
+    drawMesh(_jointMesh, (M * Scaling(jointScale)).matrix(),
+             Vector3f(0.8f, 0.4f, 0.4f));
 
     // phi = joint angle 0
     // theta = joint angle 1
     M = M * AngleAxisf(_jointAngles(1, i), Vector3f::UnitY()); 
 
     // Draw segment.
-    setObjectMatrix(_shader, (M * Scaling(1.f, 1.f, _lengths[i])).matrix());
-    glUniform3fv(_shader.getUniformLocation("color"), 1,
-                 Vector3f(0.8f, 0.8f, 0.4f).data());
-    _segmentMesh.draw(_shader);
+    drawMesh(_segmentMesh, (M * Scaling(1.f, 1.f, _lengths[i])).matrix(),
+             Vector3f(0.8f, 0.8f, 0.4f));
 
     // _length = segment length
     M = M * Translation3f(0, 0, _lengths[i]);
@@ -221,12 +277,19 @@ void Viewer::drawCylinder() {
   glActiveTexture(GL_TEXTURE0);
   glUniform1i(_cylinderShader.getUniformLocation("colormap"), 0);
 
-  _grid.draw(_cylinderShader);
+  // 2 triangles per cell, one instance per row of cells
+  glUniform2i(_cylinderShader.getUniformLocation("grid_res"), _gridResolution.x(),
+              _gridResolution.y());
+  glBindVertexArray(_emptyVAO);
+  glDrawArraysInstanced(GL_TRIANGLES, 0, 6 * _gridResolution.x(),
+                        _gridResolution.y());
 
   _cylinderShader.deactivate();
 }
 
 void Viewer::updateAndDrawScene() {
+  reloadShaders();
+
   if (_IK_target.norm() > 0) {
     // TODO: réaliser un pas d'IK vers _IK_target
     // 1. Calculer la position courante de l'extrémité en espace monde. 
@@ -263,19 +326,101 @@ void Viewer::updateAndDrawScene() {
 
     VectorXf gradient = J.transpose() * (_IK_target - currentPos) * 0.01 * M_PI; 
      Eigen::VectorXf::Map(_jointAngles.data(), 2*n) += gradient;
+
+    solveArmContacts();
   }
   drawScene();
 }
 
+// pushes the joints (spheres) and segments (capsules) of the arm out of _scene: the deepest contact of
+// each proxy gives a displacement of its axis, turned into angles by damped least squares on the
+// rotations moving that point. A few passes per frame, as resolving a contact may create another one.
+void Viewer::solveArmContacts() {
+  // bring the CPU geometry up to date with the current pose (no-op for rigid meshes)
+  _scene.updateSkinning();
+
+  int n = int(_lengths.size());
+  std::vector<Vector3f> pivots(n + 1), axes(2 * n), dirs(n);
+  std::vector<Contact> contacts;
+  for (int iter = 0; iter < maxContactIterations; ++iter) {
+    Affine3f M;
+    M.setIdentity();
+    for (int i = 0; i < n; ++i) {
+      pivots[i] = M.translation();
+      axes[2 * i] = M.linear().col(2);
+      M = M * AngleAxisf(_jointAngles(0, i), Vector3f::UnitZ());
+      axes[2 * i + 1] = M.linear().col(1);
+      M = M * AngleAxisf(_jointAngles(1, i), Vector3f::UnitY());
+      dirs[i] = M.linear().col(2);
+      M = M * Translation3f(0, 0, _lengths[i]);
+    }
+    pivots[n] = M.translation();
+
+    VectorXf delta = VectorXf::Zero(2 * n);
+    bool colliding = false;
+    // proxy 2i: segment i, starting out of its joint, proxy 2i+1: joint i+1 (the base joint is fixed)
+    for (int p = 0; p < 2 * n - 1; ++p) {
+      int i = p / 2;
+      bool isJoint = p % 2 == 1;
+      float radius = isJoint ? jointScale : segmentRadius;
+      bool overlap =
+          isJoint ? _scene.overlapSphere(pivots[i + 1], radius, contacts)
+                  : _scene.overlapCapsule(pivots[i] + jointScale * dirs[i],
+                                          pivots[i + 1], radius, contacts);
+      if (!overlap)
+        continue;
+      colliding = true;
+      const Contact *deepest = &contacts[0];
+      for (const Contact &c : contacts)
+        if (c.depth > deepest->depth)
+          deepest = &c;
+
+      // the point of the axis, moved by the rotations of the joints 0 to i
+      Vector3f q = deepest->point + deepest->normal * (radius - deepest->depth);
+      int m = 2 * (i + 1);
+      MatrixXf Jq(3, m);
+      for (int k = 0; k < m; ++k)
+        Jq.col(k) = axes[k].cross(q - pivots[k / 2]);
+      Vector3f push = deepest->normal * (deepest->depth + contactMargin);
+      Matrix3f JJt = Jq * Jq.transpose() + 1e-3f * Matrix3f::Identity();
+      delta.head(m) += Jq.transpose() * JJt.ldlt().solve(push);
+    }
+    if (!colliding)
+      break;
+    Eigen::VectorXf::Map(_jointAngles.data(), 2 * n) += delta;
+  }
+}
+
 void Viewer::loadShaders() {
-  // Here we can load as many shaders as we want, currently we have only one:
+  // Here we can load as many shaders as we want:
   _shader.loadFromFiles(DATA_DIR "/shaders/simple.vert",
                         DATA_DIR "/shaders/simple.frag");
+  // compile-time variant, with the geometry shader computing edge distances
+  _wireframeShader.loadFromFiles(
+      DATA_DIR "/shaders/simple.vert", DATA_DIR "/shaders/simple.frag",
+      DATA_DIR "/shaders/simple.geom", std::vector<std::string>(1, "WIREFRAME"));
   _cylinderShader.loadFromFiles(DATA_DIR "/shaders/cylinder.vert",
                                 DATA_DIR "/shaders/cylinder.frag");
   checkError();
 }
 
+// recompiles the shaders whose sources have been modified, without stalling the rendering:
+// the new programs are swapped in by pollReload() once the driver is done with them
+void Viewer::reloadShaders() {
+  std::set<std::string> files = _shaderWatcher.changedFiles();
+  Shader *shaders[] = {&_shader, &_wireframeShader, &_cylinderShader};
+  for (Shader *shader : shaders) {
+    for (const std::string &file : files) {
+      if (shader->usesFile(file)) {
+        shader->reload();
+        break;
+      }
+    }
+    if (shader->pollReload())
+      std::cout << "Shader reloaded" << std::endl;
+  }
+}
+
 bool Viewer::pickAt(const Eigen::Vector2f &p, Hit &hit) const {
   Matrix4f proj4 = _cam.projectionMatrix();
   Matrix3f proj3;
@@ -305,6 +450,9 @@ void Viewer::mousePressed(GLFWwindow * /*window*/, int /*button*/, int action,
       (action == GLFW_PRESS)) {
     // picking
 
+    // bring the CPU geometry up to date with the current pose (no-op for rigid meshes)
+    _scene.updateSkinning();
+
     Hit hit;
     if (pickAt(_lastMousePos.cast<float>(), hit)) {
       _IK_target = hit.intersectionPoint();
@@ -347,9 +495,28 @@ void Viewer::mouseScroll(double /*x*/, double y) {
 void Viewer::keyPressed(int key, int action, int /*mods*/) {
   if (action == GLFW_PRESS) {
     if (key == GLFW_KEY_R) {
-      loadShaders();
+      _shader.reload();
+      _wireframeShader.reload();
+      _cylinderShader.reload();
     } else if (key == GLFW_KEY_W) {
       _wireframe = !_wireframe;
+    } else if (key == GLFW_KEY_F) {
+      _culling = !_culling;
+      std::cout << "Frustum culling " << (_culling ? "on" : "off") << std::endl;
+    } else if (key == GLFW_KEY_L) {
+      _useLODs = !_useLODs;
+      std::cout << "Levels of detail " << (_useLODs ? "on" : "off") << std::endl;
+    } else if (key == GLFW_KEY_I) {
+      std::cout << "objects: " << _cullingStats.objectsVisible << " visible, "
+                << _cullingStats.objectsCulled << " culled; clusters: "
+                << _cullingStats.clustersVisible << " visible, "
+                << _cullingStats.clustersCulled << " culled; "
+                << _cullingStats.triangles << " triangles" << std::endl;
+      const RenderStats &rs = _renderQueue.stats();
+      std::cout << "render queue: " << rs.items << " items, "
+                << rs.drawCalls << " draw calls, " << rs.programChanges
+                << " program, " << rs.meshChanges << " vertex array, "
+                << rs.textureChanges << " texture changes" << std::endl;
     }
   }
 
@@ -359,7 +526,9 @@ void Viewer::keyPressed(int key, int action, int /*mods*/) {
     } else if (key == GLFW_KEY_LEFT) {
     } else if (key == GLFW_KEY_RIGHT) {
     } else if (key == GLFW_KEY_PAGE_UP) {
+      _gridResolution = (_gridResolution * 2).cwiseMin(4096);
     } else if (key == GLFW_KEY_PAGE_DOWN) {
+      _gridResolution = (_gridResolution / 2).cwiseMax(1);
     }
   }
 }
@@ -6,6 +6,9 @@
 #include "camera.h"
 #include "trackball.h"
 #include "mesh.h"
+#include "frustum.h"
+#include "file_watcher.h"
+#include "render_queue.h"
 
 #include <iostream>
 
@@ -23,6 +26,9 @@ public:
     void updateAndDrawScene();
     void reshape(int w, int h);
     void loadShaders();
+    void reloadShaders();
+
+    Camera& camera() { return _cam; }
 
     // events
     void mousePressed(GLFWwindow* window, int button, int action, int mods);
@@ -35,18 +41,25 @@ private:
 
     bool pickAt(const Eigen::Vector2f &p, Hit &hit) const;
     void setObjectMatrix(Shader &shader, const Eigen::Matrix4f &M) const;
+    void drawMesh(Mesh &mesh, const Eigen::Matrix4f &M, const Eigen::Vector3f &color);
     void drawArticulatedArm();
     void drawCylinder();
+    void solveArmContacts();
 
     int _winWidth, _winHeight;
 
     Camera _cam;
-    Shader _shader, _cylinderShader;
+    Shader _shader, _wireframeShader, _cylinderShader;
+    Shader *_activeShader; ///< the variant of _shader used for the current frame
+    FileWatcher _shaderWatcher; ///< reloads the shaders when their sources are saved
     Mesh   _scene;
     Mesh   _sphere;
     Mesh   _jointMesh;
     Mesh   _segmentMesh;
-    Mesh   _grid;
+
+    // the cylinder is generated by the vertex shader from a procedural grid
+    unsigned int _emptyVAO;
+    Eigen::Vector2i _gridResolution;
 
     int _texid;
 
@@ -57,6 +70,12 @@ private:
 
     bool _wireframe;
 
+    bool _culling;
+    bool _useLODs;
+    Eigen::Matrix4f _viewProj; ///< proj*view of the current frame, for frustum culling
+    CullingStats _cullingStats;
+    RenderQueue _renderQueue; ///< the draws of the frame, sorted by state
+
 
     // Mouse parameters for the trackball
     enum TrackMode